@@ -13,396 +13,4794 @@
  *
  * This code is in the public domain.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <ar.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <pthread.h>
 #include <elf.h>
 
-/* Reads an ULEB128 (variable-length integer) value from the file descriptor.
+#include "armattr.h"
 
-   'pos' is the current position within the section and 'size' is the
-   size of the section. The function will take care not to run outside
-   of the section. */
-int parse_uleb128(int fd, unsigned long int* result, off_t* pos, size_t size)
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+/* Where report() output goes on this thread; NULL means stdout.
+   Worker threads point it at a per-file buffer. */
+static __thread FILE* report_stream;
+
+/* With --dump or --query, output is NDJSON: one record per attribute,
+   and messages become error records of the file being processed. */
+static int report_json;
+static __thread const char* report_path;
+static __thread const char* report_member;
+static __thread char report_line[512];
+static __thread size_t report_line_len;
+
+FILE* report_out()
+{
+  return report_stream != NULL ? report_stream : stdout;
+}
+
+/* Prints 'str' as a JSON string, or null. */
+void report_json_string(const char* str)
+{
+  FILE* out = report_out();
+  if (str == NULL)
+  {
+    fputs("null", out);
+    return;
+  }
+  
+  putc('"', out);
+  for (const unsigned char* p = (const unsigned char*)str; *p; ++p)
+  {
+    if (*p == '"' || *p == '\\')
+      fprintf(out, "\\%c", *p);
+    else if (*p < 0x20)
+      fprintf(out, "\\u%04x", *p);
+    else
+      putc(*p, out);
+  }
+  putc('"', out);
+}
+
+/* Starts a JSON record with the current file's path and member. */
+void report_json_begin()
+{
+  fputs("{\"path\":", report_out());
+  report_json_string(report_path);
+  fputs(",\"member\":", report_out());
+  report_json_string(report_member);
+}
+
+/* Prints the complete lines collected in report_line as error records. */
+void report_json_flush()
+{
+  char* nl;
+  while ((nl = memchr(report_line, '\n', report_line_len)) != NULL)
+  {
+    *nl = '\0';
+    char* msg = report_line;
+    if (strncmp(msg, "Error: ", 7) == 0)
+      msg += 7;
+    if (*msg != '\0')
+    {
+      report_json_begin();
+      fputs(",\"error\":", report_out());
+      report_json_string(msg);
+      fputs("}\n", report_out());
+    }
+    report_line_len -= nl + 1 - report_line;
+    memmove(report_line, nl + 1, report_line_len);
+  }
+}
+
+/* Prints a per-file message. */
+void report(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void report(const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  if (!report_json)
+    vfprintf(report_out(), format, args);
+  else
+  {
+    size_t room = sizeof(report_line) - report_line_len;
+    int len = vsnprintf(report_line + report_line_len, room, format, args);
+    report_line_len += (len < 0) ? 0 : ((size_t)len < room ? (size_t)len : room - 1);
+    report_json_flush();
+  }
+  va_end(args);
+}
+
+/* Starts the output for the file 'path', or for 'member' of the
+   archive 'path' (either may be NULL): the "path: " or "path(member): "
+   prefix of its status line, or the names put into its JSON records. */
+void report_file(const char* path, const char* member)
+{
+  report_path = path;
+  report_member = member;
+  if (report_json)
+    report_line_len = 0;
+  else if (path != NULL && member != NULL)
+    report("%s(%s): ", path, member);
+  else
+    report("%s: ", path != NULL ? path : member);
+}
+
+/* Starts another status line for the current file, with the same
+   prefix as the first. */
+void report_next_line()
+{
+  if (!report_json && (report_path != NULL || report_member != NULL))
+    report_file(report_path, report_member);
+}
+
+/* Reports a failed system call on stdout, so that in batch mode each
+   file's errors end up on its own status line. */
+void report_error(const char* what)
+{
+  report("Error: %s: %s.\n", what, strerror(errno));
+}
+
+/* Settings from the command line, shared by all files. */
+struct options
+{
+  struct armattr_tag_value* sets;    // attributes to patch (-w, --set)
+  int nsets;
+  struct armattr_tag_value* conds;   // patch only files with these values (--if)
+  int nconds;
+  unsigned long* removes;    // attributes to delete (--remove)
+  int nremoves;
+  int preserve_timestamps;   // restore atime/mtime after patching
+  int io_uring;              // batch file I/O through io_uring
+  size_t prefetch;           // bytes to read speculatively per file, or 0
+  int physical_order;        // process batches in on-disk order
+  int dump;                  // print every attribute as JSON
+  unsigned long* query;      // or only these tags
+  int nquery;
+};
+
+/* Checks whether attribute 'tag' is to be printed as JSON. */
+int wants_attr(const struct options* opts, unsigned long tag)
+{
+  if (opts->dump)
+    return 1;
+  for (int i=0; i<opts->nquery; ++i)
+  {
+    if (opts->query[i] == tag)
+      return 1;
+  }
+  return 0;
+}
+
+/* Checks whether files are to be modified at all. */
+int patching(const struct options* opts)
+{
+  return opts->nsets > 0 || opts->nremoves > 0;
+}
+
+/* Number of patches written by this thread, so that callers can tell
+   whether a file was actually modified. */
+static __thread unsigned long patch_count;
+
+/* The scan index (--index): what parsing each ELF image found, so that
+   later runs can answer from it without reading the image again. Each
+   entry is keyed by the device, inode, size, mtime and ctime of the
+   file, and the offset of the image in it (nonzero for archive
+   members), so a file modified in any way no longer matches and is
+   parsed again. Its records are the attributes in the order they were
+   parsed, with the file offsets of their values, which is all that
+   displaying or patching them in place needs.
+
+   On disk it's a header, the entries sorted by key, their records and
+   a pool of strings, in host byte order; the file is mapped read-only
+   while running, and what was parsed during the run is merged in when
+   it is saved at exit. */
+#define INDEX_MAGIC    "AWTINDEX"
+#define INDEX_VERSION  2
+#define INDEX_NONE     0xffffffffu
+
+struct index_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t nentries;
+  uint64_t nrecords;
+  uint64_t pool_size;
+};
+
+struct index_entry
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t base;       // offset of the ELF image within the file
+  uint64_t size;
+  int64_t mtime_ns;
+  int64_t ctime_ns;
+  uint64_t first;      // index of its first record
+  uint32_t nrecords;
+  uint32_t unused;
+};
+
+/* An attribute, or a vendor subsection other than "aeabi". */
+struct index_record
+{
+  uint64_t offset;     // of the value or subsection within the file
+  uint64_t value;
+  uint32_t tag;
+  uint32_t len;
+  uint32_t str;        // pool offset of the string value or vendor name
+  uint32_t ids;        // pool offset of the section or symbol numbers
+  uint32_t ids_len;
+  uint32_t vendor;     // pool offset of the vendor of an AArch64 attribute
+  uint8_t kind;        // ARMATTR_ATTR or ARMATTR_VENDOR
+  uint8_t scope;
+  uint16_t unused;
+};
+
+/* An entry with its records and the pool their strings are in. */
+struct index_image
+{
+  struct index_entry entry;
+  const struct index_record* records;
+  const unsigned char* pool;
+};
+
+/* Collects the records of an image while it is being parsed. */
+struct index_builder
+{
+  struct index_record* records;
+  uint32_t nrecords;
+  uint32_t records_cap;
+  unsigned char* pool;
+  size_t pool_len;
+  size_t pool_cap;
+  int failed;          // something couldn't be recorded
+};
+
+struct scan_index
+{
+  int enabled;
+  void* map;
+  size_t map_size;
+  const struct index_entry* entries;
+  uint32_t nentries;
+  const struct index_record* records;
+  const unsigned char* pool;
+  unsigned char* stale;        // per mapped entry: the image has changed
+  struct index_image* added;   // images parsed during this run
+  size_t nadded;
+  size_t added_cap;
+  pthread_mutex_t lock;
+};
+
+static struct scan_index scan_index = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+int64_t timespec_ns(const struct timespec* ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+void index_key(struct index_entry* entry, const struct stat* st, off_t base)
+{
+  memset(entry, 0, sizeof(*entry));
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->base = base;
+  entry->size = st->st_size;
+  entry->mtime_ns = timespec_ns(&st->st_mtim);
+  entry->ctime_ns = timespec_ns(&st->st_ctim);
+}
+
+int compare_index_key(const struct index_entry* a, const struct index_entry* b)
+{
+  if (a->dev != b->dev)
+    return a->dev < b->dev ? -1 : 1;
+  if (a->ino != b->ino)
+    return a->ino < b->ino ? -1 : 1;
+  if (a->base != b->base)
+    return a->base < b->base ? -1 : 1;
+  return 0;
+}
+
+/* Checks that a pool offset of the mapped index is INDEX_NONE or a
+   string within the pool. */
+int index_pool_string(uint32_t offset, uint64_t pool_size)
+{
+  return offset == INDEX_NONE ||
+         (offset < pool_size && memchr(scan_index.pool + offset, 0, pool_size - offset) != NULL);
+}
+
+/* Maps the index file at 'path', if there is one. An index that can't
+   be used is ignored with a warning, and replaced when saving. */
+int index_open(const char* path)
+{
+  scan_index.enabled = 1;
+  
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+  {
+    if (errno == ENOENT)
+      return 0;
+    fprintf(stderr, "Error: opening index %s: %s.\n", path, strerror(errno));
+    return 1;
+  }
+  
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct index_header))
+  {
+    close(fd);
+    fprintf(stderr, "Warning: ignoring invalid index %s.\n", path);
+    return 0;
+  }
+  
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    fprintf(stderr, "Error: mapping index %s: %s.\n", path, strerror(errno));
+    return 1;
+  }
+  
+  const struct index_header* header = map;
+  size_t size = st.st_size - sizeof(*header);
+  if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_VERSION ||
+      header->nrecords > size / sizeof(struct index_record) || header->pool_size > size ||
+      (size_t)header->nentries * sizeof(struct index_entry) + header->nrecords * sizeof(struct index_record) + header->pool_size != size)
+  {
+    munmap(map, st.st_size);
+    fprintf(stderr, "Warning: ignoring invalid index %s.\n", path);
+    return 0;
+  }
+  
+  scan_index.map = map;
+  scan_index.map_size = st.st_size;
+  scan_index.nentries = header->nentries;
+  scan_index.entries = (const struct index_entry*)(header + 1);
+  scan_index.records = (const struct index_record*)(scan_index.entries + header->nentries);
+  scan_index.pool = (const unsigned char*)(scan_index.records + header->nrecords);
+  scan_index.stale = calloc(header->nentries ? header->nentries : 1, 1);
+  if (scan_index.stale == NULL)
+  {
+    perror("allocating index");
+    exit(1);
+  }
+  
+  // don't trust anything pointing outside of the file
+  for (uint32_t i=0; i<header->nentries; ++i)
+  {
+    const struct index_entry* entry = &scan_index.entries[i];
+    if (entry->first > header->nrecords || entry->nrecords > header->nrecords - entry->first)
+      scan_index.stale[i] = 1;
+  }
+  for (uint64_t i=0; i<header->nrecords; ++i)
+  {
+    const struct index_record* record = &scan_index.records[i];
+    if (!index_pool_string(record->str, header->pool_size) || !index_pool_string(record->vendor, header->pool_size) ||
+        record->ids > header->pool_size || record->ids_len > header->pool_size - record->ids)
+    {
+      fprintf(stderr, "Warning: ignoring invalid index %s.\n", path);
+      scan_index.nentries = 0;
+      break;
+    }
+  }
+  return 0;
+}
+
+/* Looks up the image at 'base' within the file 'st'. Returns nonzero
+   if it is in the index and the file hasn't changed since, with its
+   records in 'image' and its position, for index_mark_stale(), in
+   'pos'. */
+int index_find(const struct stat* st, off_t base, struct index_image* image, size_t* pos)
+{
+  struct index_entry key;
+  index_key(&key, st, base);
+  
+  int found = 0;
+  pthread_mutex_lock(&scan_index.lock);
+  size_t lo = 0, hi = scan_index.nentries;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = compare_index_key(&scan_index.entries[mid], &key);
+    if (cmp == 0)
+    {
+      const struct index_entry* entry = &scan_index.entries[mid];
+      if (entry->size != key.size || entry->mtime_ns != key.mtime_ns || entry->ctime_ns != key.ctime_ns)
+        scan_index.stale[mid] = 1;
+      else if (!scan_index.stale[mid])
+      {
+        image->entry = *entry;
+        image->records = scan_index.records + entry->first;
+        image->pool = scan_index.pool;
+        *pos = mid;
+        found = 1;
+      }
+      break;
+    }
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  pthread_mutex_unlock(&scan_index.lock);
+  return found;
+}
+
+/* Drops a mapped entry whose image is being modified. */
+void index_mark_stale(size_t pos)
+{
+  pthread_mutex_lock(&scan_index.lock);
+  scan_index.stale[pos] = 1;
+  pthread_mutex_unlock(&scan_index.lock);
+}
+
+/* Adds 'len' bytes to the builder's pool, returning their offset. */
+uint32_t index_pool_add(struct index_builder* builder, const void* data, size_t len)
+{
+  if (len == 0)
+    return builder->pool_len;
+  if (builder->pool_len + len > INDEX_NONE - 1)
+  {
+    builder->failed = 1;
+    return INDEX_NONE;
+  }
+  if (builder->pool_len + len > builder->pool_cap)
+  {
+    size_t cap = builder->pool_cap ? builder->pool_cap : 64;
+    while (cap < builder->pool_len + len)
+      cap *= 2;
+    unsigned char* pool = realloc(builder->pool, cap);
+    if (pool == NULL)
+    {
+      builder->failed = 1;
+      return INDEX_NONE;
+    }
+    builder->pool = pool;
+    builder->pool_cap = cap;
+  }
+  uint32_t offset = builder->pool_len;
+  memcpy(builder->pool + offset, data, len);
+  builder->pool_len += len;
+  return offset;
+}
+
+/* Records an attribute or vendor subsection of a section that lies at
+   'sh_offset' within the file. Images with anything that doesn't fit
+   into a record are simply not indexed. */
+void index_record_attr(struct index_builder* builder, int kind, const struct armattr_attr* attr, off_t sh_offset)
+{
+  if (builder->failed)
+    return;
+  if (attr->tag > UINT32_MAX || attr->len > UINT32_MAX || attr->scope > UINT8_MAX)
+  {
+    builder->failed = 1;
+    return;
+  }
+  
+  if (builder->nrecords == builder->records_cap)
+  {
+    uint32_t cap = builder->records_cap ? builder->records_cap * 2 : 16;
+    struct index_record* records = realloc(builder->records, cap * sizeof(*records));
+    if (records == NULL)
+    {
+      builder->failed = 1;
+      return;
+    }
+    builder->records = records;
+    builder->records_cap = cap;
+  }
+  
+  struct index_record* record = &builder->records[builder->nrecords++];
+  memset(record, 0, sizeof(*record));
+  record->offset = sh_offset + attr->offset;
+  record->value = attr->value;
+  record->tag = attr->tag;
+  record->len = attr->len;
+  record->kind = kind;
+  record->scope = attr->scope;
+  record->str = INDEX_NONE;
+  record->vendor = INDEX_NONE;
+  if (kind == ARMATTR_ATTR && attr->vendor.ptr != NULL && strcmp(attr->vendor.ptr, "aeabi") != 0)
+    record->vendor = index_pool_add(builder, attr->vendor.ptr, attr->vendor.len + 1);
+  if (kind == ARMATTR_VENDOR)
+    record->str = index_pool_add(builder, attr->vendor.ptr, attr->vendor.len + 1);
+  else if (attr->str.ptr != NULL)
+    record->str = index_pool_add(builder, attr->str.ptr, attr->str.len + 1);
+  record->ids_len = attr->ids_end - attr->ids;
+  record->ids = index_pool_add(builder, attr->ids, record->ids_len);
+}
+
+void index_builder_free(struct index_builder* builder)
+{
+  free(builder->records);
+  free(builder->pool);
+}
+
+/* Adds the image at 'base' within the file 'st' to the index, taking
+   over the builder's records. */
+void index_add(const struct stat* st, off_t base, struct index_builder* builder)
+{
+  if (builder->failed)
+  {
+    index_builder_free(builder);
+    return;
+  }
+  
+  pthread_mutex_lock(&scan_index.lock);
+  if (scan_index.nadded == scan_index.added_cap)
+  {
+    scan_index.added_cap = scan_index.added_cap ? scan_index.added_cap * 2 : 256;
+    scan_index.added = realloc(scan_index.added, scan_index.added_cap * sizeof(*scan_index.added));
+    if (scan_index.added == NULL)
+    {
+      perror("allocating index");
+      exit(1);
+    }
+  }
+  struct index_image* image = &scan_index.added[scan_index.nadded++];
+  index_key(&image->entry, st, base);
+  image->entry.nrecords = builder->nrecords;
+  image->records = builder->records;
+  image->pool = builder->pool;
+  pthread_mutex_unlock(&scan_index.lock);
+}
+
+/* Orders images by key, with the ones added during this run first. */
+int compare_index_images(const void* a, const void* b)
+{
+  const struct index_image* ia = a;
+  const struct index_image* ib = b;
+  int cmp = compare_index_key(&ia->entry, &ib->entry);
+  if (cmp != 0)
+    return cmp;
+  // 'unused' holds 0 for added images and 1 for mapped ones here
+  return (int)ia->entry.unused - (int)ib->entry.unused;
+}
+
+/* Writes the mapped entries that are still valid and those added during
+   this run to 'path', replacing it atomically. Returns nonzero on error. */
+int index_save(const char* path)
+{
+  size_t n = 0;
+  struct index_image* images = malloc((scan_index.nentries + scan_index.nadded + 1) * sizeof(*images));
+  if (images == NULL)
+  {
+    perror("allocating index");
+    return 1;
+  }
+  for (size_t i=0; i<scan_index.nadded; ++i)
+  {
+    images[n] = scan_index.added[i];
+    images[n++].entry.unused = 0;
+  }
+  for (uint32_t i=0; i<scan_index.nentries; ++i)
+  {
+    if (scan_index.stale[i])
+      continue;
+    images[n].entry = scan_index.entries[i];
+    images[n].entry.unused = 1;
+    images[n].records = scan_index.records + scan_index.entries[i].first;
+    images[n++].pool = scan_index.pool;
+  }
+  qsort(images, n, sizeof(*images), compare_index_images);
+  
+  // copy the records and their strings into one pool, dropping images
+  // that were parsed again
+  struct index_builder out;
+  memset(&out, 0, sizeof(out));
+  struct index_entry* entries = malloc((n + 1) * sizeof(*entries));
+  uint32_t nentries = 0;
+  if (entries == NULL)
+  {
+    perror("allocating index");
+    free(images);
+    return 1;
+  }
+  for (size_t i=0; i<n; ++i)
+  {
+    const struct index_image* image = &images[i];
+    if (nentries > 0 && compare_index_key(&entries[nentries-1], &image->entry) == 0)
+      continue;
+    
+    struct index_entry* entry = &entries[nentries++];
+    *entry = image->entry;
+    entry->unused = 0;
+    entry->first = out.nrecords;
+    for (uint32_t j=0; j<image->entry.nrecords; ++j)
+    {
+      const struct index_record* record = &image->records[j];
+      struct armattr_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.offset = record->offset;
+      attr.len = record->len;
+      attr.tag = record->tag;
+      attr.value = record->value;
+      attr.scope = record->scope;
+      attr.ids = image->pool + record->ids;
+      attr.ids_end = attr.ids + record->ids_len;
+      if (record->str != INDEX_NONE)
+      {
+        const char* str = (const char*)image->pool + record->str;
+        struct armattr_str* view = (record->kind == ARMATTR_VENDOR) ? &attr.vendor : &attr.str;
+        view->ptr = str;
+        view->len = strlen(str);
+      }
+      if (record->vendor != INDEX_NONE)
+      {
+        attr.vendor.ptr = (const char*)image->pool + record->vendor;
+        attr.vendor.len = strlen(attr.vendor.ptr);
+      }
+      index_record_attr(&out, record->kind, &attr, 0);
+    }
+  }
+  
+  int ret = 0;
+  if (out.failed)
+  {
+    fprintf(stderr, "Error: index too large.\n");
+    ret = 1;
+  }
+  
+  char tmp[PATH_MAX];
+  FILE* file = NULL;
+  if (ret == 0 && snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+  {
+    fprintf(stderr, "Error: index path too long.\n");
+    ret = 1;
+  }
+  if (ret == 0 && (file = fopen(tmp, "wb")) == NULL)
+  {
+    fprintf(stderr, "Error: creating index %s: %s.\n", tmp, strerror(errno));
+    ret = 1;
+  }
+  if (ret == 0)
+  {
+    struct index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.nentries = nentries;
+    header.nrecords = out.nrecords;
+    header.pool_size = out.pool_len;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(entries, sizeof(*entries), nentries, file);
+    fwrite(out.records, sizeof(*out.records), out.nrecords, file);
+    fwrite(out.pool, 1, out.pool_len, file);
+    int failed = ferror(file);
+    if (fclose(file) != 0)
+      failed = 1;
+    if (failed || rename(tmp, path) != 0)
+    {
+      fprintf(stderr, "Error: writing index %s: %s.\n", path, strerror(errno));
+      unlink(tmp);
+      ret = 1;
+    }
+  }
+  
+  index_builder_free(&out);
+  free(entries);
+  free(images);
+  return ret;
+}
+
+/* Saves and closes the index, if there is one. Returns nonzero if
+   'ret' is, or saving failed. */
+int index_close(const char* path, int ret)
+{
+  if (path == NULL)
+    return ret;
+  if (index_save(path) != 0)
+    ret = 1;
+  for (size_t i=0; i<scan_index.nadded; ++i)
+  {
+    free((void*)scan_index.added[i].records);
+    free((void*)scan_index.added[i].pool);
+  }
+  free(scan_index.added);
+  free(scan_index.stale);
+  if (scan_index.map != NULL)
+    munmap(scan_index.map, scan_index.map_size);
+  return ret;
+}
+
+/* The status line of an attribute that was displayed or patched. */
+struct status
+{
+  unsigned long tag;
+  unsigned long value;
+  char* str;                            // the value of string attributes
+  const struct armattr_tag_value* set;  // NULL when only displayed
+  int removed;
+};
+
+/* What parsing one ELF image (a file or an archive member) produced.
+   Parsing is kept free of I/O; the caller reads the data in and
+   writes the planned patches out. */
+struct parse_state
+{
+  const struct options* opts;
+  struct armattr_edits edits;
+  int found;           // Tag_ABI_PCS_wchar_t was seen
+  struct armattr_plan plan;
+  struct status* lines;
+  int nlines;
+  int lines_cap;
+  
+  // bit i is set once conds[i] was seen at file scope with the value
+  // it asks for, or with another one
+  unsigned long long conds_met;
+  unsigned long long conds_failed;
+  
+  // the file being parsed, and where the sh_size of the section being
+  // parsed is, so that it can be shrunk when rebuilt
+  const struct armattr_elf* elf;
+  off_t size_field;
+  
+  // collects every attribute for the scan index, or NULL
+  struct index_builder* record;
+  
+  // Tags looked up when displaying, so that parsing can stop early:
+  // bit i of 'pending' is set until query[i] has been seen at file
+  // scope, and 'done' is set once all of them have.
+  const unsigned long* query;
+  int nquery;
+  unsigned long long pending;
+  int done;
+};
+
+/* Plans how much of a file the parser has to look at. Patching and
+   --dump need every attribute; looking tags up, which includes just
+   displaying Tag_ABI_PCS_wchar_t, is done once each of them has been
+   found at file scope, which is where toolchains put them. */
+void parse_state_init(struct parse_state* state, const struct options* opts)
+{
+  static const unsigned long wchar_tag = 18;
+  
+  memset(state, 0, sizeof(*state));
+  state->opts = opts;
+  state->edits.sets = opts->sets;
+  state->edits.nsets = opts->nsets;
+  state->edits.removes = opts->removes;
+  state->edits.nremoves = opts->nremoves;
+  armattr_plan_init(&state->plan);
+  
+  if (patching(opts) || opts->dump)
+    return;
+  if (opts->nquery > 0)
+  {
+    state->query = opts->query;
+    state->nquery = opts->nquery;
+  }
+  else
+  {
+    state->query = &wchar_tag;
+    state->nquery = 1;
+  }
+  state->pending = (state->nquery == 64) ? ~0ULL : (1ULL << state->nquery) - 1;
+}
+
+/* Marks file-scope attribute 'tag' as seen. Returns nonzero once every
+   tag looked up has been. */
+int parse_state_resolve(struct parse_state* state, unsigned long tag)
+{
+  for (int i=0; i<state->nquery; ++i)
+  {
+    if (state->query[i] == tag)
+      state->pending &= ~(1ULL << i);
+  }
+  state->done = (state->query != NULL && state->pending == 0);
+  return state->done;
+}
+
+void parse_state_free(struct parse_state* state)
+{
+  armattr_plan_free(&state->plan);
+  for (int i=0; i<state->nlines; ++i)
+    free(state->lines[i].str);
+  free(state->lines);
+  state->lines = NULL;
+  state->nlines = state->lines_cap = 0;
+}
+
+/* Looks a tag up by name ("Tag_CPU_arch") or number, for --query.
+   Returns nonzero if there is no such tag. */
+int parse_tag(const char* arg, unsigned long* tag)
+{
+  const struct armattr_tag* name = armattr_find_tag_name(arg);
+  if (name != NULL)
+  {
+    *tag = name->tag;
+    return 0;
+  }
+  
+  char* end;
+  *tag = strtoul(arg, &end, 0);
+  return (*arg == '\0' || *end != '\0');
+}
+
+/* Prints one attribute, whose value lies at 'offset' within the file,
+   as a JSON record. */
+void report_attr(const struct armattr_attr* attr, off_t offset)
+{
+  static const char* const scopes[] = { NULL, "file", "section", "symbol" };
+  FILE* out = report_out();
+  
+  report_json_begin();
+  fputs(",\"vendor\":", out);
+  report_json_string(attr->vendor.ptr);
+  fputs(",\"scope\":", out);
+  report_json_string(attr->scope < 4 ? scopes[attr->scope] : NULL);
+  if (attr->ids < attr->ids_end)
+  {
+    fputs(",\"ids\":[", out);
+    size_t pos = 0, len = attr->ids_end - attr->ids;
+    unsigned long id;
+    const char* sep = "";
+    while (pos < len && armattr_uleb128(attr->ids, &id, &pos, len) == 0 && id != 0)
+    {
+      fprintf(out, "%s%lu", sep, id);
+      sep = ",";
+    }
+    putc(']', out);
+  }
+  
+  const struct armattr_tag* name = armattr_find_vendor_tag(attr->vendor.ptr, attr->tag);
+  char unknown[32];
+  snprintf(unknown, sizeof(unknown), "Tag_%lu", attr->tag);
+  fputs(",\"tag\":", out);
+  report_json_string(name != NULL ? name->name : unknown);
+  fprintf(out, ",\"number\":%lu,\"value\":", attr->tag);
+  
+  const char* str = attr->str.ptr;
+  unsigned long value = attr->value;
+  if (str != NULL && attr->tag != 32)
+    report_json_string(str);
+  else
+  {
+    fprintf(out, "%lu", value);
+    if (str != NULL)
+    {
+      fputs(",\"string\":", out);
+      report_json_string(str);
+    }
+    if (name != NULL && value < (unsigned long)name->nvalues && name->values[value] != NULL)
+    {
+      fputs(",\"decoded\":", out);
+      report_json_string(name->values[value]);
+    }
+  }
+  fprintf(out, ",\"offset\":%lld}\n", (long long)offset);
+}
+
+/* Prints a vendor subsection other than "aeabi", which we can't decode. */
+void report_vendor(const char* vendor, off_t offset, size_t size)
+{
+  report_json_begin();
+  fputs(",\"vendor\":", report_out());
+  report_json_string(vendor);
+  fprintf(report_out(), ",\"offset\":%lld,\"size\":%zu}\n", (long long)offset, size);
+}
+
+/* Returns the name of attribute 'tag' in 'buf', or a static string. */
+const char* tag_string(unsigned long tag, char* buf, size_t size)
+{
+  const struct armattr_tag* name = armattr_find_tag(tag);
+  if (name != NULL)
+    return name->name;
+  snprintf(buf, size, "Tag_%lu", tag);
+  return buf;
+}
+
+/* Handles an attribute: notes it for the --if conditions, and records
+   its status line if it is Tag_ABI_PCS_wchar_t or being changed. */
+int check_attr(struct parse_state* state, const struct armattr_attr* attr)
+{
+  const struct options* opts = state->opts;
+  const char* str = attr->str.ptr;
+  
+  for (int i=0; i<opts->nconds && str == NULL; ++i)
+  {
+    if (attr->scope == ARMATTR_FILE && opts->conds[i].tag == attr->tag)
+    {
+      if (opts->conds[i].value == attr->value)
+        state->conds_met |= 1ULL << i;
+      else
+        state->conds_failed |= 1ULL << i;
+    }
+  }
+  
+  const struct armattr_tag_value* set = (str == NULL) ? armattr_find_set(&state->edits, attr->tag) : NULL;
+  int removed = armattr_is_removed(&state->edits, attr->tag);
+  if (report_json || (set == NULL && !removed && attr->tag != 18))
+    return 0;
+  if (attr->tag == 18)
+    state->found = 1;
+  
+  if (state->nlines == state->lines_cap)
+  {
+    int cap = state->lines_cap ? state->lines_cap * 2 : 4;
+    struct status* lines = realloc(state->lines, cap * sizeof(*lines));
+    if (lines == NULL)
+    {
+      report_error("allocating status lines");
+      return 1;
+    }
+    state->lines = lines;
+    state->lines_cap = cap;
+  }
+  struct status* line = &state->lines[state->nlines++];
+  line->tag = attr->tag;
+  line->value = attr->value;
+  line->str = (str != NULL) ? strdup(str) : NULL;
+  line->set = set;
+  line->removed = removed;
+  return 0;
+}
+
+/* Finishes a successfully parsed file: drops its patches unless all
+   --if conditions hold, so that either all of them or none are
+   written, and prints its status lines. */
+void parse_state_finish(struct parse_state* state)
+{
+  const struct options* opts = state->opts;
+  unsigned long long all = (opts->nconds == 64) ? ~0ULL : (1ULL << opts->nconds) - 1;
+  int met = (state->conds_met == all && state->conds_failed == 0);
+  if (!met)
+    armattr_plan_clear(&state->plan);
+  
+  if (report_json)
+    return;
+  
+  for (int i=0; i<state->nlines; ++i)
+  {
+    const struct status* line = &state->lines[i];
+    char buf[32];
+    if (i > 0)
+      report_next_line();
+    if (line->str != NULL)
+      report("%s = %s", tag_string(line->tag, buf, sizeof(buf)), line->str);
+    else
+      report("%s = %lu", tag_string(line->tag, buf, sizeof(buf)), line->value);
+    if (line->removed)
+      report(met ? ", removed\n" : ", not removed: condition not met\n");
+    else if (line->set == NULL)
+      report("\n");
+    else if (line->set->value == line->value)
+    {
+      // nothing to do: don't dirty the file or bump its mtime
+      report(", unchanged\n");
+    }
+    else if (!met)
+      report(", not patched: condition not met\n");
+    else
+      report(", patched to %lu\n", line->set->value);
+  }
+  
+  // make sure every file gets a status line
+  if (!state->found)
+  {
+    if (state->nlines > 0)
+      report_next_line();
+    report("No Tag_ABI_PCS_wchar_t.\n");
+  }
+}
+
+/* Handles an attribute, or a vendor subsection, of a section that
+   lies at 'sh_offset' within the file. */
+int parse_attr(struct parse_state* state, int kind, const struct armattr_attr* attr, off_t sh_offset)
+{
+  if (kind == ARMATTR_VENDOR)
+  {
+    if (report_json && state->opts->dump)
+      report_vendor(attr->vendor.ptr, sh_offset + attr->offset, attr->len);
+    return 0;
+  }
+  
+  // AArch64 attributes have subsections of their own, and are only
+  // dumped: tags looked up and edited are aeabi ones
+  if (strcmp(attr->vendor.ptr, "aeabi") != 0)
+  {
+    if (report_json && state->opts->dump)
+      report_attr(attr, sh_offset + attr->offset);
+    return 0;
+  }
+  
+  if (check_attr(state, attr) != 0)
+    return 1;
+  
+  if (report_json && wants_attr(state->opts, attr->tag))
+    report_attr(attr, sh_offset + attr->offset);
+  
+  // the rest can only be other tags, or narrower scopes of these
+  if (attr->scope == ARMATTR_FILE)
+    parse_state_resolve(state, attr->tag);
+  return 0;
+}
+
+/* Signatures of the attributes sections that toolchains commonly
+   emit, for finding Tag_ABI_PCS_wchar_t without decoding what comes
+   before it. A signature is the bytes of the file-scope attributes in
+   the first aeabi sub-subsection, up to and including the tag of
+   Tag_ABI_PCS_wchar_t (the value varies, as do the lengths in the
+   headers before them). Besides the few built in, layouts that parsing
+   finds are added as it goes, so a run over objects from one
+   toolchain soon matches them with a single memcmp. */
+#define SIGNATURE_START  16   // 'A', subsection length, "aeabi", scope, size
+#define SIGNATURE_MAX    64
+#define SIGNATURES_MAX   64
+
+struct signature
+{
+  const uint8_t* bytes;
+  size_t len;
+};
+
+#define SIGNATURE(s) { (const uint8_t*)(s), sizeof(s) - 1 }
+
+static const struct signature known_signatures[] =
+{
+  // GNU as for armhf (-march=armv7-a -mfpu=vfpv3-d16 -mthumb)
+  SIGNATURE("\x05" "7-A\0" "\x06\x0a" "\x07\x41" "\x08\x01" "\x09\x02" "\x0a\x04" "\x12"),
+  // for armel (-march=armv5te, soft float)
+  SIGNATURE("\x05" "5TE\0" "\x06\x04" "\x08\x01" "\x09\x01" "\x12"),
+  // for Cortex-M3 and Cortex-M4 with FPU (arm-none-eabi)
+  SIGNATURE("\x05" "cortex-m3\0" "\x06\x0a" "\x07\x4d" "\x09\x02" "\x12"),
+  SIGNATURE("\x05" "cortex-m4\0" "\x06\x0d" "\x07\x4d" "\x09\x02" "\x0a\x06" "\x12"),
+};
+
+struct signatures
+{
+  struct signature learned[SIGNATURES_MAX];
+  int nlearned;                // read without the lock
+  unsigned long checked;       // sections looked at, for --stats
+  unsigned long matched;
+  pthread_mutex_t lock;
+};
+
+static struct signatures signatures = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Checks that only Tag_ABI_PCS_wchar_t is being displayed, which is
+   all a signature can tell, of a little-endian ARM file. */
+int signature_applies(const struct parse_state* state)
+{
+  const struct armattr_elf* elf = state->elf;
+  if (elf != NULL && (elf->big_endian || elf->machine != EM_ARM))
+    return 0;
+  return !report_json && !patching(state->opts) && state->query != NULL && state->record == NULL;
+}
+
+/* Checks the headers before the attributes of a section, returning
+   the end of its first sub-subsection, or 0. */
+size_t signature_header(const uint8_t* data, size_t size)
+{
+  Elf32_Word subsect_size, subsub_size;
+  if (size < SIGNATURE_START || data[0] != 'A' || memcmp(data + 5, "aeabi", 6) != 0 || data[11] != ARMATTR_FILE)
+    return 0;
+  memcpy(&subsect_size, data + 1, sizeof(subsect_size));
+  memcpy(&subsub_size, data + 12, sizeof(subsub_size));
+  if (subsect_size < SIGNATURE_START - 1 || subsect_size > size - 1 || subsub_size < 5 || subsub_size > subsect_size - 10)
+    return 0;
+  return (11 + subsub_size < size) ? 11 + subsub_size : size;
+}
+
+/* Handles a section whose layout matches a signature. Returns -1 if
+   none does, so that it has to be parsed. */
+int signature_parse(const uint8_t* data, size_t size, off_t sh_offset, struct parse_state* state)
+{
+  __atomic_fetch_add(&signatures.checked, 1, __ATOMIC_RELAXED);
+  size_t end = signature_header(data, size);
+  if (end == 0)
+    return -1;
+  
+  int nknown = sizeof(known_signatures) / sizeof(known_signatures[0]);
+  int nlearned = __atomic_load_n(&signatures.nlearned, __ATOMIC_ACQUIRE);
+  for (int i=0; i<nknown + nlearned; ++i)
+  {
+    const struct signature* sig = (i < nknown) ? &known_signatures[i] : &signatures.learned[i - nknown];
+    size_t pos = SIGNATURE_START + sig->len;
+    if (pos >= end || memcmp(data + SIGNATURE_START, sig->bytes, sig->len) != 0)
+      continue;
+    
+    struct armattr_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.vendor.ptr = (const char*)data + 5;
+    attr.vendor.len = 5;
+    attr.offset = pos;
+    attr.scope = ARMATTR_FILE;
+    attr.ids = attr.ids_end = data + SIGNATURE_START;
+    attr.tag = 18;
+    if (armattr_uleb128(data, &attr.value, &pos, end) != 0)
+      return -1;
+    attr.len = pos - attr.offset;
+    
+    __atomic_fetch_add(&signatures.matched, 1, __ATOMIC_RELAXED);
+    return parse_attr(state, ARMATTR_ATTR, &attr, sh_offset);
+  }
+  return -1;
+}
+
+/* Adds the layout of a section in which Tag_ABI_PCS_wchar_t was just
+   found at 'attr', if it has one that a signature can describe. */
+void signature_learn(const uint8_t* data, size_t size, const struct armattr_attr* attr, const struct parse_state* state)
+{
+  if (!signature_applies(state) || attr->tag != 18 || attr->offset <= SIGNATURE_START || attr->offset - SIGNATURE_START > SIGNATURE_MAX)
+    return;
+  size_t end = signature_header(data, size);
+  if (end < attr->offset + attr->len)
+    return;
+  
+  size_t len = attr->offset - SIGNATURE_START;
+  pthread_mutex_lock(&signatures.lock);
+  int n = signatures.nlearned;
+  for (int i=0; i<n; ++i)
+  {
+    if (signatures.learned[i].len == len && memcmp(signatures.learned[i].bytes, data + SIGNATURE_START, len) == 0)
+      n = SIGNATURES_MAX;
+  }
+  uint8_t* bytes = (n < SIGNATURES_MAX) ? malloc(len) : NULL;
+  if (bytes != NULL)
+  {
+    memcpy(bytes, data + SIGNATURE_START, len);
+    signatures.learned[n].bytes = bytes;
+    signatures.learned[n].len = len;
+    __atomic_store_n(&signatures.nlearned, n + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&signatures.lock);
+}
+
+void signatures_free()
+{
+  for (int i=0; i<signatures.nlearned; ++i)
+    free((void*)signatures.learned[i].bytes);
+  signatures.nlearned = 0;
+}
+
+/* Parse results of attributes sections, keyed by their contents.
+   Objects built by the same toolchain usually have byte-identical
+   .ARM.attributes sections, so each distinct one is decoded once, and
+   later ones are handled from the attributes found then, whose
+   offsets within the section are the same. Entries hold a copy of the
+   section, which the attributes point into, and are never freed. */
+#define MEMO_MAX_BYTES  (16 * 1024 * 1024)
+
+struct memo_attr
+{
+  int kind;            // ARMATTR_ATTR or ARMATTR_VENDOR
+  struct armattr_attr attr;
+};
+
+struct memo_entry
+{
+  uint64_t hash;
+  int format;          // the same bytes decode differently in other formats
+  size_t size;
+  uint8_t* data;
+  struct memo_attr* attrs;
+  int nattrs;
+};
+
+struct memo
+{
+  struct memo_entry** slots;
+  size_t capacity;     // power of two
+  size_t count;
+  size_t bytes;        // held by the entries, up to MEMO_MAX_BYTES
+  pthread_mutex_t lock;
+};
+
+static struct memo memo = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* A 64-bit hash of a byte string, taken eight bytes at a time. */
+uint64_t hash_bytes(const uint8_t* data, size_t len)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    h = (h ^ word) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, len - i);
+  h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 29);
+}
+
+/* Tells apart the formats of attributes sections: byte order, and ARM
+   or AArch64. */
+int memo_format(const struct armattr_elf* elf)
+{
+  if (elf == NULL)
+    return 0;
+  return elf->big_endian | (elf->machine == EM_AARCH64) << 1;
+}
+
+/* Finds the entry for the section in [data, data + size). Call with
+   the lock held. */
+struct memo_entry* memo_find(uint64_t hash, int format, const uint8_t* data, size_t size)
+{
+  if (memo.count == 0)
+    return NULL;
+  for (size_t i = hash & (memo.capacity - 1); memo.slots[i] != NULL; i = (i + 1) & (memo.capacity - 1))
+  {
+    struct memo_entry* entry = memo.slots[i];
+    if (entry->hash == hash && entry->format == format && entry->size == size && memcmp(entry->data, data, size) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+/* Inserts 'entry', or returns an equal one another thread got in
+   first. Returns NULL if it can't be added. Call with the lock held. */
+struct memo_entry* memo_insert(struct memo_entry* entry)
+{
+  struct memo_entry* found = memo_find(entry->hash, entry->format, entry->data, entry->size);
+  if (found != NULL)
+    return found;
+  
+  if ((memo.count + 1) * 2 > memo.capacity)
+  {
+    size_t capacity = memo.capacity ? memo.capacity * 2 : 64;
+    struct memo_entry** slots = calloc(capacity, sizeof(*slots));
+    if (slots == NULL)
+      return NULL;
+    for (size_t i=0; i<memo.capacity; ++i)
+    {
+      if (memo.slots[i] != NULL)
+      {
+        size_t j = memo.slots[i]->hash & (capacity - 1);
+        while (slots[j] != NULL)
+          j = (j + 1) & (capacity - 1);
+        slots[j] = memo.slots[i];
+      }
+    }
+    free(memo.slots);
+    memo.slots = slots;
+    memo.capacity = capacity;
+  }
+  
+  size_t i = entry->hash & (memo.capacity - 1);
+  while (memo.slots[i] != NULL)
+    i = (i + 1) & (memo.capacity - 1);
+  memo.slots[i] = entry;
+  ++memo.count;
+  memo.bytes += entry->size + entry->nattrs * sizeof(*entry->attrs);
+  return entry;
+}
+
+void memo_entry_free(struct memo_entry* entry)
+{
+  free(entry->data);
+  free(entry->attrs);
+  free(entry);
+}
+
+/* Decodes a whole section into a new entry. Returns NULL if it has
+   errors, which are left to be reported by parsing it as usual. */
+struct memo_entry* memo_decode(uint64_t hash, const struct armattr_elf* elf, const uint8_t* data, size_t size)
+{
+  struct memo_entry* entry = calloc(1, sizeof(*entry));
+  if (entry == NULL || (entry->data = malloc(size)) == NULL)
+  {
+    free(entry);
+    return NULL;
+  }
+  entry->hash = hash;
+  entry->format = memo_format(elf);
+  entry->size = size;
+  memcpy(entry->data, data, size);
+  
+  struct armattr_iter it;
+  struct armattr_attr attr;
+  int ret, cap = 0;
+  if (armattr_iter_init_elf(&it, elf, entry->data, size) != 0)
+  {
+    memo_entry_free(entry);
+    return NULL;
+  }
+  while ((ret = armattr_next(&it, &attr)) != ARMATTR_END)
+  {
+    if (ret == ARMATTR_ERROR)
+    {
+      memo_entry_free(entry);
+      return NULL;
+    }
+    if (entry->nattrs == cap)
+    {
+      cap = cap ? cap * 2 : 16;
+      struct memo_attr* attrs = realloc(entry->attrs, cap * sizeof(*attrs));
+      if (attrs == NULL)
+      {
+        memo_entry_free(entry);
+        return NULL;
+      }
+      entry->attrs = attrs;
+    }
+    entry->attrs[entry->nattrs].kind = ret;
+    entry->attrs[entry->nattrs].attr = attr;
+    ++entry->nattrs;
+  }
+  return entry;
+}
+
+/* Returns the entry for the section in [data, data + size), decoding
+   it if it is new. Returns NULL if it has to be parsed as usual: it
+   has errors, or the memo is full. */
+const struct memo_entry* memo_lookup(const struct armattr_elf* elf, const uint8_t* data, size_t size)
+{
+  uint64_t hash = hash_bytes(data, size);
+  pthread_mutex_lock(&memo.lock);
+  struct memo_entry* found = memo_find(hash, memo_format(elf), data, size);
+  int full = (memo.bytes + size > MEMO_MAX_BYTES);
+  pthread_mutex_unlock(&memo.lock);
+  if (found != NULL || full)
+    return found;
+  
+  struct memo_entry* entry = memo_decode(hash, elf, data, size);
+  if (entry == NULL)
+    return NULL;
+  pthread_mutex_lock(&memo.lock);
+  found = memo_insert(entry);
+  pthread_mutex_unlock(&memo.lock);
+  if (found != entry)
+    memo_entry_free(entry);
+  return found;
+}
+
+/* Handles a section from its memo entry, like parse_eabi_attr_data().
+   Patches are planned in place at the offsets found when it was
+   decoded, unless the section has to be rebuilt. */
+int parse_memo(const struct memo_entry* entry, off_t sh_offset, struct parse_state* state)
+{
+  for (int i=0; i<entry->nattrs; ++i)
+  {
+    const struct memo_attr* m = &entry->attrs[i];
+    if (state->record != NULL)
+      index_record_attr(state->record, m->kind, &m->attr, sh_offset);
+    if (!state->done && parse_attr(state, m->kind, &m->attr, sh_offset) != 0)
+      return 1;
+    if (state->done && state->record == NULL)
+    {
+      signature_learn(entry->data, entry->size, &m->attr, state);
+      return 0;
+    }
+  }
+  
+  // the edits are of aeabi attributes, which AArch64 files don't have
+  if (!patching(state->opts) || (state->elf != NULL && state->elf->machine == EM_AARCH64))
+    return 0;
+  
+  struct armattr_plan* plan = &state->plan;
+  int npatches = plan->npatches;
+  size_t data_len = plan->data_len;
+  struct armattr_error error;
+  for (int i=0; i<entry->nattrs; ++i)
+  {
+    const struct armattr_attr* attr = &entry->attrs[i].attr;
+    if (entry->attrs[i].kind != ARMATTR_ATTR || strcmp(attr->vendor.ptr, "aeabi") != 0)
+      continue;
+    
+    int ret = armattr_plan_attr(plan, &state->edits, attr, sh_offset + attr->offset, &error);
+    if (ret == ARMATTR_ERROR)
+    {
+      report("Error: %s\n", error.msg);
+      return 1;
+    }
+    if (ret == ARMATTR_REBUILD)
+    {
+      // drop what was planned for this section and rebuild it instead
+      plan->npatches = npatches;
+      plan->data_len = data_len;
+      if (armattr_plan_section(plan, &state->edits, state->elf, entry->data, entry->size, sh_offset, state->size_field, &error) != 0)
+      {
+        report("Error: %s\n", error.msg);
+        return 1;
+      }
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/* Parses the contents of an ARM attributes ELF section, which lies
+   at 'sh_offset' within the file, and plans the patches to it. Once
+   the tags looked up are resolved, the rest is only recorded for the
+   index, if there is one. Sections with a known layout, or seen
+   before when they have to be decoded in full, are handled from their
+   signature or the memo instead. */
+int parse_eabi_attr_data(const unsigned char* data, off_t sh_offset, size_t sh_size, struct parse_state* state)
+{
+  if (signature_applies(state))
+  {
+    int ret = signature_parse(data, sh_size, sh_offset, state);
+    if (ret >= 0)
+      return ret;
+  }
+  
+  // lookups stop early, which costs less than hashing and decoding
+  // the whole section, unless all of it is recorded for the index
+  if (state->query == NULL || state->record != NULL)
+  {
+    const struct memo_entry* entry = memo_lookup(state->elf, data, sh_size);
+    if (entry != NULL)
+      return parse_memo(entry, sh_offset, state);
+  }
+  
+  struct armattr_iter it;
+  struct armattr_attr attr;
+  int ret;
+  
+  if (armattr_iter_init_elf(&it, state->elf, data, sh_size) != 0)
+  {
+    report("Error: %s\n", it.error.msg);
+    return 1;
+  }
+  
+  while ((ret = armattr_next(&it, &attr)) != ARMATTR_END)
+  {
+    if (ret == ARMATTR_ERROR)
+    {
+      report("Error: %s\n", it.error.msg);
+      return 1;
+    }
+    
+    if (state->record != NULL)
+      index_record_attr(state->record, ret, &attr, sh_offset);
+    if (!state->done && parse_attr(state, ret, &attr, sh_offset) != 0)
+      return 1;
+    if (state->done && state->record == NULL)
+    {
+      signature_learn(data, sh_size, &attr, state);
+      return 0;
+    }
+  }
+  
+  if (!patching(state->opts))
+    return 0;
+  
+  struct armattr_error error;
+  if (armattr_plan_section(&state->plan, &state->edits, state->elf, data, sh_size, sh_offset, state->size_field, &error) != 0)
+  {
+    report("Error: %s\n", error.msg);
+    return 1;
+  }
+  return 0;
+}
+
+/* Reads one ELF file. Every pread() is a round trip to the server on
+   network and FUSE filesystems, which costs far more than the bytes it
+   moves, so with --prefetch the first read speculatively fetches a
+   whole block from the start of the file. For small objects that
+   already covers the section table and the attributes. Otherwise,
+   reader_fetch_tail() gets the section table in one more read together
+   with the block before it, where toolchains put .ARM.attributes, and
+   only unusual layouts need a third. Archive members are read through
+   the archive's blocks first, so that small members cost no reads of
+   their own. */
+struct reader
+{
+  int fd;
+  off_t base;
+  off_t end;             // end of an archive member, or 0
+  const struct reader* archive;  // whose blocks are read first, or NULL
+  size_t prefetch;       // size of the speculative reads, 0 for plain preads
+  int fetched;           // the head block was read
+  unsigned char* head;   // [head_off, head_off + head_len)
+  off_t head_off;
+  size_t head_len;
+  unsigned char* tail;   // [tail_off, tail_off + tail_len)
+  off_t tail_off;
+  size_t tail_len;
+};
+
+void reader_init(struct reader* reader, int fd, off_t base, const struct options* opts)
+{
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = fd;
+  reader->base = base;
+  reader->head_off = base;
+  reader->prefetch = opts->prefetch;
+}
+
+/* Sets up a reader for the archive member in [base, end), served from
+   the blocks 'archive' already holds where they cover it. */
+void reader_init_member(struct reader* reader, const struct reader* archive, off_t base, off_t end, const struct options* opts)
+{
+  reader_init(reader, archive->fd, base, opts);
+  reader->end = end;
+  reader->archive = archive;
+}
+
+void reader_free(struct reader* reader)
+{
+  free(reader->head);
+  free(reader->tail);
+}
+
+/* Copies [off, off + len) out of a buffer holding [buf_off, buf_off +
+   buf_len), if it's entirely inside. 'dst' may be NULL to only check. */
+int reader_copy(void* dst, size_t len, off_t off, const unsigned char* buf, off_t buf_off, size_t buf_len)
+{
+  if (buf == NULL || off < buf_off || (size_t)(off - buf_off) > buf_len || len > buf_len - (off - buf_off))
+    return 0;
+  if (dst != NULL)
+    memcpy(dst, buf + (off - buf_off), len);
+  return 1;
+}
+
+/* Like reader_copy(), from the blocks the reader, or the archive whose
+   member it reads, already holds. */
+int reader_buffered(const struct reader* reader, void* dst, size_t len, off_t off)
+{
+  for (; reader != NULL; reader = reader->archive)
+  {
+    if (reader_copy(dst, len, off, reader->head, reader->head_off, reader->head_len) ||
+        reader_copy(dst, len, off, reader->tail, reader->tail_off, reader->tail_len))
+      return 1;
+  }
+  return 0;
+}
+
+/* Reads the head block, starting where the archive's blocks stop
+   covering the member, if they do, and ending with the member. */
+int reader_fetch_head(struct reader* reader)
+{
+  reader->fetched = 1;
+  off_t start = reader->base;
+  const struct reader* archive = reader->archive;
+  if (archive != NULL && reader_copy(NULL, 0, start, archive->head, archive->head_off, archive->head_len))
+    start = archive->head_off + archive->head_len;
+  if (archive != NULL && reader_copy(NULL, 0, start, archive->tail, archive->tail_off, archive->tail_len))
+    start = archive->tail_off + archive->tail_len;
+  reader->head_off = start;
+  
+  size_t size = reader->prefetch;
+  if (reader->end != 0 && (off_t)size > reader->end - start)
+    size = (reader->end > start) ? reader->end - start : 0;
+  if (size == 0)
+    return 0;
+  
+  reader->head = malloc(size);
+  if (reader->head == NULL)
+    return -1;
+  ssize_t got = pread(reader->fd, reader->head, size, start);
+  if (got < 0)
+    return -1;
+  reader->head_len = got;
+  return 0;
+}
+
+/* Like pread(), but served from the prefetched blocks when possible. */
+ssize_t reader_read(struct reader* reader, void* dst, size_t len, off_t off)
+{
+  if (reader->prefetch > 0 && !reader->fetched && reader_fetch_head(reader) != 0)
+    return -1;
+  
+  if (reader_buffered(reader, dst, len, off))
+    return len;
+  
+  return pread(reader->fd, dst, len, off);
+}
+
+/* Fetches [off, off + len) along with up to a prefetch block before
+   it, unless the blocks already have it. A failure here is not an
+   error; the data is simply read again on demand. */
+void reader_fetch_tail(struct reader* reader, off_t off, size_t len)
+{
+  if (reader->prefetch == 0 || !reader->fetched || reader_buffered(reader, NULL, len, off))
+    return;
+  
+  off_t head_end = reader->head_off + reader->head_len;
+  off_t start = off - (off_t)reader->prefetch;
+  if (start < head_end)
+    start = head_end;
+  if (start > off)
+    start = off;
+  
+  size_t size = off + len - start;
+  reader->tail = malloc(size);
+  if (reader->tail == NULL)
+    return;
+  ssize_t got = pread(reader->fd, reader->tail, size, start);
+  if (got < 0)
+    got = 0;
+  reader->tail_off = start;
+  reader->tail_len = got;
+}
+
+/* Makes [off, off + len) available from a prefetch block starting
+   there, unless the blocks already have it, replacing the tail block.
+   Archive headers are read this way, so that a run of small members
+   comes in with one read. */
+void reader_fetch_ahead(struct reader* reader, off_t off, size_t len)
+{
+  if (reader->prefetch == 0 || reader_buffered(reader, NULL, len, off))
+    return;
+  
+  size_t size = (len > reader->prefetch) ? len : reader->prefetch;
+  unsigned char* block = malloc(size);
+  if (block == NULL)
+    return;
+  ssize_t got = pread(reader->fd, block, size, off);
+  if (got < 0)
+  {
+    free(block);
+    return;
+  }
+  free(reader->tail);
+  reader->tail = block;
+  reader->tail_off = off;
+  reader->tail_len = got;
+}
+
+/* Parses the ARM attributes ELF section.
+
+   The whole section is loaded with a single read and decoded in
+   memory. */
+int parse_eabi_attr_section(struct reader* reader, off_t sh_offset, size_t sh_size, struct parse_state* state)
+{
+  if (sh_size < 1)
+  {
+    report("Error: Empty ARM attributes section.\n");
+    return 1;
+  }
+  
+  unsigned char* data = malloc(sh_size);
+  if (data == NULL)
+  {
+    report_error("allocating attributes section");
+    return 1;
+  }
+  
+  if (reader_read(reader, data, sh_size, sh_offset) != (ssize_t)sh_size)
+  {
+    report_error("reading attributes section");
+    free(data);
+    return 1;
+  }
+  
+  int ret = parse_eabi_attr_data(data, sh_offset, sh_size, state);
+  
+  free(data);
+  return ret;
+}
+
+/* Reads an ELF header, checking that it is one we can handle. */
+int read_ehdr(const uint8_t* data, ssize_t size, struct armattr_elf* elf)
+{
+  struct armattr_error error;
+  if (size < 0)
+  {
+    report_error("reading ELF header");
+    return 1;
+  }
+  if (armattr_read_ehdr(data, size, elf, &error) == 0)
+    return 0;
+  report("Error: %s\n", error.msg);
+  return 1;
+}
+
+/* Writes out the patches planned in 'state'. */
+int apply_patches(int fd, const struct parse_state* state)
+{
+  const struct armattr_plan* plan = &state->plan;
+  for (int i=0; i<plan->npatches; ++i)
+  {
+    const struct armattr_patch* patch = &plan->patches[i];
+    if (pwrite(fd, plan->data + patch->data, patch->len, patch->offset) != (ssize_t)patch->len)
+    {
+      report_error("patching");
+      return 1;
+    }
+    ++patch_count;
+  }
+  return 0;
+}
+
+/* Processes an ELF image from its index entry instead of parsing it,
+   writing any patches to 'fd'. Returns -1, having done nothing, if it
+   has to be parsed after all because the section must be rebuilt. */
+int index_replay(const struct index_image* image, size_t pos, int fd, const struct options* opts)
+{
+  struct parse_state state;
+  parse_state_init(&state, opts);
+  int ret = 0;
+  
+  struct armattr_attr* attrs = calloc(image->entry.nrecords + 1, sizeof(*attrs));
+  if (attrs == NULL)
+  {
+    report_error("allocating attributes");
+    return 1;
+  }
+  for (uint32_t i=0; i<image->entry.nrecords; ++i)
+  {
+    const struct index_record* record = &image->records[i];
+    struct armattr_attr* attr = &attrs[i];
+    attr->vendor.ptr = "aeabi";
+    attr->offset = record->offset;
+    attr->len = record->len;
+    attr->scope = record->scope;
+    attr->ids = image->pool + record->ids;
+    attr->ids_end = attr->ids + record->ids_len;
+    attr->tag = record->tag;
+    attr->value = record->value;
+    if (record->str != INDEX_NONE)
+    {
+      struct armattr_str* str = (record->kind == ARMATTR_VENDOR) ? &attr->vendor : &attr->str;
+      str->ptr = (const char*)image->pool + record->str;
+      str->len = strlen(str->ptr);
+    }
+    if (record->vendor != INDEX_NONE)
+    {
+      attr->vendor.ptr = (const char*)image->pool + record->vendor;
+      attr->vendor.len = strlen(attr->vendor.ptr);
+    }
+    
+    // edits are of aeabi attributes only
+    if (record->kind == ARMATTR_ATTR && record->vendor == INDEX_NONE && patching(opts))
+    {
+      struct armattr_error error;
+      int planned = armattr_plan_attr(&state.plan, &state.edits, attr, attr->offset, &error);
+      if (planned == ARMATTR_REBUILD)
+        ret = -1;
+      else if (planned == ARMATTR_ERROR)
+      {
+        report("Error: %s\n", error.msg);
+        ret = 1;
+      }
+      if (ret != 0)
+        break;
+    }
+  }
+  
+  for (uint32_t i=0; i<image->entry.nrecords && ret == 0 && !state.done; ++i)
+    ret = parse_attr(&state, image->records[i].kind, &attrs[i], 0);
+  
+  if (ret == 0)
+  {
+    parse_state_finish(&state);
+    if (state.plan.npatches > 0)
+      index_mark_stale(pos);
+    ret = apply_patches(fd, &state);
+  }
+  
+  parse_state_free(&state);
+  free(attrs);
+  return ret;
+}
+
+/* Looks 'filename' up in the scan index as an ELF file, when only
+   displaying, like index_find(); 'image' and 'pos' may be NULL. */
+int index_lookup(int dirfd, const char* filename, const struct options* opts, struct index_image* image, size_t* pos)
+{
+  struct stat st;
+  struct index_image found;
+  size_t found_pos;
+  return scan_index.enabled && !patching(opts) && fstatat(dirfd, filename, &st, 0) == 0 &&
+         index_find(&st, 0, image ? image : &found, pos ? pos : &found_pos);
+}
+
+/* Answers for 'filename' from the scan index without even opening it,
+   when only displaying. Returns -1 if it isn't in the index as an ELF
+   file (archives are looked up member by member once opened). */
+int index_process(int dirfd, const char* filename, const char* display, const struct options* opts)
+{
+  struct index_image image;
+  size_t pos;
+  if (!index_lookup(dirfd, filename, opts, &image, &pos))
+    return -1;
+  
+  if (display != NULL)
+    report_file(display, NULL);
+  return index_replay(&image, pos, -1, opts);
+}
+
+/* Parses the ELF file that starts at the reader's base. */
+int parse_elf(struct reader* reader, const struct options* opts)
+{
+  int fd = reader->fd;
+  off_t base = reader->base;
+  
+  struct stat st;
+  int indexed = scan_index.enabled && fstat(fd, &st) == 0;
+  if (indexed)
+  {
+    struct index_image image;
+    size_t pos;
+    if (index_find(&st, base, &image, &pos))
+    {
+      int ret = index_replay(&image, pos, fd, opts);
+      if (ret >= 0)
+        return ret;
+      index_mark_stale(pos);
+    }
+  }
+  
+  // the header of either class; a short read is told apart from it
+  uint8_t ehdr[ARMATTR_EHDR_SIZE];
+  struct armattr_elf elf;
+  if (read_ehdr(ehdr, reader_read(reader, ehdr, sizeof(ehdr), base), &elf) != 0)
+    return 1;
+  
+  // read the whole section header table at once
+  size_t shtab_size = (size_t)elf.shnum * elf.shentsize;
+  uint8_t* shdrs = malloc(shtab_size);
+  if (shdrs == NULL)
+  {
+    report_error("allocating section header table");
+    return 1;
+  }
+  
+  reader_fetch_tail(reader, base + elf.shoff, shtab_size);
+  if (reader_read(reader, shdrs, shtab_size, base + elf.shoff) != (ssize_t)shtab_size)
+  {
+    report_error("reading section header table");
+    free(shdrs);
+    return 1;
+  }
+  
+  // toolchains usually emit .ARM.attributes near the end, so scan backwards
+  struct parse_state state;
+  parse_state_init(&state, opts);
+  struct index_builder builder;
+  memset(&builder, 0, sizeof(builder));
+  if (indexed)
+    state.record = &builder;
+  state.elf = &elf;
+  int ret = 0;
+  int index = -1;
+  struct armattr_section section;
+  while (armattr_next_section(&elf, shdrs, &index, &section) > 0)
+  {
+    state.size_field = base + section.size_field;
+    ret = parse_eabi_attr_section(reader, base + section.offset, section.size, &state);
+    if (ret != 0 || (state.done && state.record == NULL))
+      break;
+  }
+  
+  if (ret == 0)
+  {
+    parse_state_finish(&state);
+    ret = apply_patches(fd, &state);
+  }
+  
+  // images modified now are indexed when they are next looked at
+  if (indexed && ret == 0 && state.plan.npatches == 0)
+    index_add(&st, base, &builder);
+  else
+    index_builder_free(&builder);
+  
+  parse_state_free(&state);
+  free(shdrs);
+  return ret;
+}
+
+int process_at(int dirfd, const char* filename, const char* display, const struct options* opts);
+
+/* Opens a file for processing. When only displaying, the file is
+   opened read-only, which works on read-only mounts and doesn't take
+   write intent on network filesystems, and without updating its atime
+   where we are allowed to (O_NOATIME needs ownership). */
+int open_input(int dirfd, const char* filename, const struct options* opts)
+{
+  if (patching(opts))
+    return openat(dirfd, filename, O_RDWR);
+  
+  int fd = openat(dirfd, filename, O_RDONLY | O_NOATIME);
+  if (fd == -1 && errno == EPERM)
+    fd = openat(dirfd, filename, O_RDONLY);
+  return fd;
+}
+
+/* Closes a file opened by open_input(). Files that were only read are
+   dropped from the page cache, so that scanning a large tree doesn't
+   evict everybody else's working set. */
+void close_input(int fd, const struct options* opts)
+{
+  if (!patching(opts))
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+/* Saves the access and modification times of 'fd' into 'times' if
+   they are to be preserved. Returns nonzero if they were saved. */
+int save_timestamps(int fd, const struct options* opts, struct timespec times[2])
+{
+  struct stat st;
+  if (!opts->preserve_timestamps || fstat(fd, &st) != 0)
+    return 0;
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+  return 1;
+}
+
+/* Puts back timestamps saved by save_timestamps() after a patch. */
+int restore_timestamps(int fd, const struct timespec times[2])
+{
+  if (futimens(fd, times) != 0)
+  {
+    report_error("restoring timestamps");
+    return 1;
+  }
+  return 0;
+}
+
+#define THINMAG "!<thin>\n"
+
+/* Archives are patched in place: changing a tag value changes neither
+   member sizes nor symbols, so there is no need to extract, rebuild and
+   re-index them. Each ELF member is parsed at its offset within the
+   archive. Both GNU ('/' and '//' index and long name members, "name/"
+   and "/offset" names) and BSD ('__.SYMDEF' index, "#1/length" names)
+   variants are understood. Members of thin archives are separate files,
+   found relative to the archive's directory.
+
+   Scanning only reads member headers; what to do with each member is up
+   to a callback, so that members can be processed in place or handed
+   to worker threads. */
+
+struct ar_member
+{
+  int index;           // position within the archive
+  off_t data_off;      // start of the member's data, unless thin
+  off_t size;          // and its size
+  char name[PATH_MAX];
+};
+
+typedef int (*ar_member_fn)(void* ctx, const struct ar_member* member);
+
+/* Calls 'fn' for every regular member of the archive read by 'reader'.
+   Returns nonzero if the archive is corrupt or any call failed. */
+int scan_archive(struct reader* reader, const char* display, int thin, ar_member_fn fn, void* ctx)
+{
+  char* long_names = NULL;
+  size_t long_names_size = 0;
+  int ret = 0;
+  off_t off = SARMAG;
+  int index = 0;
+  struct ar_hdr hdr;
+  ssize_t got = 0;
+  
+  struct stat st;
+  if (fstat(reader->fd, &st) != 0)
+  {
+    report_error("reading archive");
+    return 1;
+  }
+  
+  while (off < st.st_size)
+  {
+    reader_fetch_ahead(reader, off, sizeof(hdr));
+    if ((got = reader_read(reader, &hdr, sizeof(hdr), off)) != sizeof(hdr))
+      break;
+    
+    // the size is decimal digits padded with spaces
+    char size_field[sizeof(hdr.ar_size) + 1];
+    memcpy(size_field, hdr.ar_size, sizeof(hdr.ar_size));
+    size_field[sizeof(hdr.ar_size)] = '\0';
+    char* end = size_field;
+    off_t size = 0;
+    while (*end >= '0' && *end <= '9')
+      size = size * 10 + (*end++ - '0');
+    while (*end == ' ')
+      ++end;
+    
+    if (memcmp(hdr.ar_fmag, ARFMAG, sizeof(hdr.ar_fmag)) != 0 || end == size_field || *end != '\0' ||
+        (!thin && size > st.st_size - off - (off_t)sizeof(hdr)))
+    {
+      report_file(display, NULL);
+      report("Error: Corrupt archive member header at offset %lld.\n", (long long)off);
+      ret = 1;
+      break;
+    }
+    
+    off_t data_off = off + sizeof(hdr);
+    off_t next = data_off + size + (size & 1);
+    
+    struct ar_member member;
+    char* name = member.name;
+    size_t name_len = 0;
+    int special = 0;
+    
+    if (memcmp(hdr.ar_name, "// ", 3) == 0)
+    {
+      // GNU long name table
+      free(long_names);
+      long_names_size = size;
+      long_names = malloc(size + 1);
+      if (long_names == NULL || reader_read(reader, long_names, size, data_off) != size)
+      {
+        report_error("reading archive name table");
+        ret = 1;
+        break;
+      }
+      long_names[size] = '\0';
+      special = 1;
+    }
+    else if (memcmp(hdr.ar_name, "/ ", 2) == 0 || memcmp(hdr.ar_name, "/SYM64/ ", 8) == 0 ||
+             memcmp(hdr.ar_name, "__.SYMDEF", 9) == 0)
+    {
+      // symbol index: unaffected by our patching
+      special = 1;
+    }
+    else if (hdr.ar_name[0] == '/')
+    {
+      // GNU long name: "/offset" into the name table
+      unsigned long name_off = strtoul(hdr.ar_name + 1, NULL, 10);
+      if (long_names == NULL || name_off >= long_names_size)
+      {
+        report_file(display, NULL);
+        report("Error: Bad archive long name reference.\n");
+        ret = 1;
+        break;
+      }
+      const char* start = long_names + name_off;
+      const char* end = strchr(start, '\n');
+      name_len = end ? (size_t)(end - start) : strlen(start);
+      if (name_len > 0 && start[name_len-1] == '/')
+        --name_len;
+      if (name_len >= sizeof(member.name))
+        name_len = sizeof(member.name) - 1;
+      memcpy(name, start, name_len);
+    }
+    else if (memcmp(hdr.ar_name, "#1/", 3) == 0)
+    {
+      // BSD long name: stored right after the header
+      size_t stored_len = strtoul(hdr.ar_name + 3, NULL, 10);
+      if (stored_len >= sizeof(member.name) || (off_t)stored_len > size ||
+          reader_read(reader, name, stored_len, data_off) != (ssize_t)stored_len)
+      {
+        report_file(display, NULL);
+        report("Error: Bad archive long name.\n");
+        ret = 1;
+        break;
+      }
+      name_len = strnlen(name, stored_len);
+      data_off += stored_len;
+      size -= stored_len;
+      special = (strncmp(name, "__.SYMDEF", 9) == 0);
+    }
+    else
+    {
+      // short name, terminated by '/' (GNU) or padded with spaces (BSD)
+      while (name_len < sizeof(hdr.ar_name) && hdr.ar_name[name_len] != '/' && hdr.ar_name[name_len] != ' ')
+        ++name_len;
+      memcpy(name, hdr.ar_name, name_len);
+    }
+    name[name_len] = '\0';
+    
+    // thin archives only store the index and name table
+    if (thin && !special)
+      next = data_off;
+    
+    if (!special)
+    {
+      member.index = index++;
+      member.data_off = data_off;
+      member.size = size;
+      if (fn(ctx, &member) != 0)
+        ret = 1;
+    }
+    
+    off = next;
+  }
+  
+  if (got == -1)
+  {
+    report_error("reading archive");
+    ret = 1;
+  }
+  
+  free(long_names);
+  return ret;
+}
+
+/* Processes one archive member, printing "display(member): " first
+   ("member: " if 'display' is NULL). 'filename' is the archive's
+   path relative to 'dirfd', needed to find thin archive members.
+   'archive' is the reader scanning the archive, whose blocks are
+   read first, or NULL. */
+int process_member(int fd, const struct reader* archive, int dirfd, const char* filename, const char* display, int thin, const struct ar_member* member, const struct options* opts)
+{
+  report_file(display, member->name);
+  
+  if (!thin)
+  {
+    struct reader reader;
+    if (archive != NULL)
+      reader_init_member(&reader, archive, member->data_off, member->data_off + member->size, opts);
+    else
+      reader_init(&reader, fd, member->data_off, opts);
+    int ret = parse_elf(&reader, opts);
+    reader_free(&reader);
+    return ret;
+  }
+  
+  char path[PATH_MAX];
+  if (member->name[0] == '/')
+    snprintf(path, sizeof(path), "%s", member->name);
+  else
+  {
+    char archive_path[PATH_MAX];
+    snprintf(archive_path, sizeof(archive_path), "%s", filename);
+    if (snprintf(path, sizeof(path), "%s/%s", dirname(archive_path), member->name) >= (int)sizeof(path))
+    {
+      report("Error: Thin archive member path too long.\n");
+      return 1;
+    }
+  }
+  return process_at(dirfd, path, NULL, opts);
+}
+
+struct process_archive_ctx
+{
+  const struct reader* reader;
+  int dirfd;
+  const char* filename;
+  const char* display;
+  int thin;
+  const struct options* opts;
+};
+
+int process_archive_member(void* ctx, const struct ar_member* member)
+{
+  struct process_archive_ctx* c = ctx;
+  return process_member(c->reader->fd, c->reader, c->dirfd, c->filename, c->display, c->thin, member, c->opts);
+}
+
+/* Returns nonzero if 'fd' is an archive, setting 'thin' accordingly. */
+int is_archive(struct reader* reader, int* thin)
+{
+  char magic[SARMAG];
+  if (reader_read(reader, magic, sizeof(magic), 0) != sizeof(magic))
+    return 0;
+  *thin = (memcmp(magic, THINMAG, SARMAG) == 0);
+  return *thin || memcmp(magic, ARMAG, SARMAG) == 0;
+}
+
+/* Processes the ELF file or archive open as 'fd', writing any patches
+   to it. */
+int process_image(int fd, int dirfd, const char* filename, const char* display, const struct options* opts)
+{
+  // the archive check shares its read with the ELF header
+  struct reader reader;
+  reader_init(&reader, fd, 0, opts);
+  
+  int ret, thin;
+  if (is_archive(&reader, &thin))
+  {
+    struct process_archive_ctx ctx = { &reader, dirfd, filename, display, thin, opts };
+    ret = scan_archive(&reader, display ? display : filename, thin, process_archive_member, &ctx);
+  }
+  else
+  {
+    if (display != NULL)
+      report_file(display, NULL);
+    ret = parse_elf(&reader, opts);
+  }
+  reader_free(&reader);
+  return ret;
+}
+
+/* Processes a file already opened by open_input(), and closes it. */
+int process_fd(int fd, int dirfd, const char* filename, const char* display, const struct options* opts)
+{
+  struct timespec times[2];
+  int saved = save_timestamps(fd, opts, times);
+  unsigned long patches = patch_count;
+  
+  int ret = process_image(fd, dirfd, filename, display, opts);
+  
+  if (saved && patch_count != patches && restore_timestamps(fd, times) != 0)
+    ret = 1;
+  
+  close_input(fd, opts);
+  
+  return ret;
+}
+
+/* Processes 'filename' (an ELF file or an archive), relative to the
+   directory 'dirfd' (or AT_FDCWD). Output lines are prefixed with
+   'display', unless it is NULL; archive members get "display(member)". */
+int process_at(int dirfd, const char* filename, const char* display, const struct options* opts)
+{
+  int ret = index_process(dirfd, filename, display, opts);
+  if (ret >= 0)
+    return ret;
+  
+  int fd = open_input(dirfd, filename, opts);
+  if (fd == -1)
+  {
+    if (display != NULL)
+      report_file(display, NULL);
+    report_error("opening file");
+    return 1;
+  }
+  
+  return process_fd(fd, dirfd, filename, display, opts);
+}
+
+int process(const char* filename, const char* display, const struct options* opts)
+{
+  return process_at(AT_FDCWD, filename, display, opts);
+}
+
+/* Filter mode (--filter): the ELF file or archive comes in on stdin
+   and goes out, patched, on stdout, for pipelines that stream objects
+   between stages. Only the start of the stream is spooled to an
+   unlinked temporary file, where it is parsed and patched like any
+   other: up to the end of the section table and the attributes
+   sections, which for most ELF files is all of it, or the whole
+   archive, whose members can be anywhere. The spooled part is then
+   copied out, and the rest of the stream forwarded untouched, within
+   the kernel where it can: with splice() when either end is a pipe,
+   with copy_file_range() between files, and read() and write()
+   otherwise. */
+
+#define FORWARD_ALL  ((size_t)-1)
+
+/* Copies up to 'len' bytes from the current position of 'in' to that
+   of 'out', stopping early at the end of 'in'. Returns the number of
+   bytes copied, or -1. */
+ssize_t forward(int in, int out, size_t len)
+{
+  static char buf[65536];
+  size_t done = 0;
+  int method = 0;      // splice(), copy_file_range(), then read()/write()
+  
+  while (done < len)
+  {
+    size_t chunk = (len - done < (1 << 30)) ? len - done : (1 << 30);
+    ssize_t n;
+    if (method == 0)
+      n = splice(in, NULL, out, NULL, chunk, SPLICE_F_MOVE);
+    else if (method == 1)
+      n = copy_file_range(in, NULL, out, NULL, chunk, 0);
+    else
+    {
+      n = read(in, buf, chunk < sizeof(buf) ? chunk : sizeof(buf));
+      for (ssize_t written = 0, w; n > 0 && written < n; written += w)
+      {
+        w = write(out, buf + written, n - written);
+        if (w < 0 && errno == EINTR)
+          w = 0;
+        else if (w < 0)
+          return -1;
+      }
+    }
+    
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && method < 2 && (errno == EINVAL || errno == EXDEV || errno == EBADF ||
+                                errno == ENOSYS || errno == EOPNOTSUPP))
+    {
+      // not supported between these two, or by this kernel
+      ++method;
+      continue;
+    }
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+/* Extends the spool with the stream on stdin until it holds 'size'
+   bytes (all of the stream if negative), or the whole stream if it is
+   shorter. */
+int spool_to(int spool, off_t* spooled, off_t size)
+{
+  if (size >= 0 && *spooled >= size)
+    return 0;
+  ssize_t n = forward(STDIN_FILENO, spool, size >= 0 ? (size_t)(size - *spooled) : FORWARD_ALL);
+  if (n < 0)
+  {
+    report_error("spooling input");
+    return 1;
+  }
+  *spooled += n;
+  return 0;
+}
+
+/* Spools as much of the stream as processing it needs: the section
+   table and attributes sections of an ELF file, or a whole archive. A
+   stream that is neither is spooled up to its header, and left for
+   processing to report. */
+int spool_image(int spool, off_t* spooled)
+{
+  uint8_t ehdr[ARMATTR_EHDR_SIZE];
+  if (spool_to(spool, spooled, sizeof(ehdr)) != 0)
+    return 1;
+  ssize_t got = pread(spool, ehdr, *spooled < (off_t)sizeof(ehdr) ? *spooled : (off_t)sizeof(ehdr), 0);
+  if (got < 0)
+  {
+    report_error("reading spool");
+    return 1;
+  }
+  
+  if (got >= SARMAG && memcmp(ehdr, THINMAG, SARMAG) == 0)
+  {
+    report("Error: Thin archives can't be filtered.\n");
+    return 1;
+  }
+  if (got >= SARMAG && memcmp(ehdr, ARMAG, SARMAG) == 0)
+    return spool_to(spool, spooled, -1);
+  
+  struct armattr_elf elf;
+  struct armattr_error error;
+  if (armattr_read_ehdr(ehdr, got, &elf, &error) != 0)
+    return 0;
+  
+  size_t shtab_size = (size_t)elf.shnum * elf.shentsize;
+  if (spool_to(spool, spooled, elf.shoff + shtab_size) != 0)
+    return 1;
+  uint8_t* shtab = malloc(shtab_size ? shtab_size : 1);
+  if (shtab == NULL)
+  {
+    report_error("allocating section header table");
+    return 1;
+  }
+  
+  // a short table is left for processing to report
+  int ret = 0;
+  if (pread(spool, shtab, shtab_size, elf.shoff) == (ssize_t)shtab_size)
+  {
+    int index = -1;
+    struct armattr_section section;
+    off_t end = 0;
+    while (armattr_next_section(&elf, shtab, &index, &section) > 0)
+    {
+      if (section.offset + (off_t)section.size > end)
+        end = section.offset + section.size;
+    }
+    ret = spool_to(spool, spooled, end);
+  }
+  free(shtab);
+  return ret;
+}
+
+/* Creates an unlinked temporary file in $TMPDIR (or /tmp). */
+int spool_open()
+{
+  const char* dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0')
+    dir = "/tmp";
+  
+  int fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+  if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+    return fd;
+  
+  // filesystems without O_TMPFILE
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/arm-wchar-tag.XXXXXX", dir) >= (int)sizeof(path))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  fd = mkstemp(path);
+  if (fd != -1)
+    unlink(path);
+  return fd;
+}
+
+/* Processes the stream on stdin, writing it to stdout. Status lines
+   go to stderr. The stream is written out even if it couldn't be
+   processed, unchanged then, so that a pipeline is never cut short. */
+int process_filter(const struct options* opts)
+{
+  report_stream = stderr;
+  if (report_json)
+    report_file("-", NULL);
+  
+  int spool = spool_open();
+  if (spool == -1)
+  {
+    report_error("creating spool file");
+    return 1;
+  }
+  
+  off_t spooled = 0;
+  int ret = spool_image(spool, &spooled);
+  if (ret == 0)
+    ret = process_image(spool, AT_FDCWD, "-", report_json ? "-" : NULL, opts);
+  
+  if (lseek(spool, 0, SEEK_SET) != 0 || forward(spool, STDOUT_FILENO, spooled) != spooled ||
+      forward(STDIN_FILENO, STDOUT_FILENO, FORWARD_ALL) < 0)
+  {
+    report_error("writing output");
+    ret = 1;
+  }
+  
+  close(spool);
+  return ret;
+}
+
+/* Batched I/O engine (--io-uring). For large file sets, even three
+   system calls per file add up, so the opens, ELF header reads, section
+   table reads, attribute section reads, patch writes and closes of many
+   files are queued on an io_uring and kept in flight together. Each
+   file is a small state machine with one request outstanding at a
+   time; the parser itself runs on the data as it arrives. Archives
+   are handed to the synchronous code once they are recognized, and
+   everything falls back to it when io_uring is unavailable. */
+
+#define URING_DEPTH 64
+
+/* One file being processed by process_batch(). */
+struct batch_file
+{
+  int dirfd;
+  const char* name;
+  const char* display;
+  char* output;
+  size_t output_size;
+  int ret;
+  size_t index;        // position in the caller's order
+};
+
+/* Processes 'files' one after the other with pread()/pwrite(). */
+int process_batch_sync(struct batch_file* files, size_t nfiles, const struct options* opts)
+{
+  int ret = 0;
+  for (size_t i=0; i<nfiles; ++i)
+  {
+    report_stream = open_memstream(&files[i].output, &files[i].output_size);
+    if (report_stream == NULL)
+    {
+      perror("allocating output");
+      exit(1);
+    }
+    files[i].ret = process_at(files[i].dirfd, files[i].name, files[i].display, opts);
+    fclose(report_stream);
+    report_stream = NULL;
+    if (files[i].ret != 0)
+      ret = 1;
+  }
+  return ret;
+}
+
+#ifdef HAVE_IO_URING
+
+/* A minimal io_uring on top of the raw system calls. */
+struct uring
+{
+  int fd;
+  unsigned entries;
+  
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned sq_local_tail;  // includes entries not yet submitted
+  unsigned to_submit;
+  struct io_uring_sqe* sqes;
+  
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+void uring_free(struct uring* ring)
+{
+  if (ring->sqes != NULL)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+}
+
+/* Sets up a ring. Returns nonzero if io_uring is not available. */
+int uring_init(struct uring* ring, unsigned entries)
+{
+  memset(ring, 0, sizeof(*ring));
+  
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+    return 1;
+  ring->entries = params.sq_entries;
+  
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+  {
+    ring->sq_ring = NULL;
+    uring_free(ring);
+    return 1;
+  }
+  
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+  {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+    {
+      ring->cq_ring = NULL;
+      uring_free(ring);
+      return 1;
+    }
+  }
+  
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+  {
+    ring->sqes = NULL;
+    uring_free(ring);
+    return 1;
+  }
+  
+  char* sq = ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring->sq_local_tail = *ring->sq_tail;
+  
+  char* cq = ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  
+  return 0;
+}
+
+/* Returns a cleared submission entry; there is always room, since no
+   more than 'entries' requests are ever in flight. */
+struct io_uring_sqe* uring_get_sqe(struct uring* ring)
+{
+  unsigned index = ring->sq_local_tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ++ring->sq_local_tail;
+  ++ring->to_submit;
+  return sqe;
+}
+
+/* Submits queued entries and waits for at least one completion. */
+int uring_submit_and_wait(struct uring* ring)
+{
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  
+  for (;;)
+  {
+    int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret >= 0)
+    {
+      ring->to_submit -= ret;
+      return 0;
+    }
+    if (errno != EINTR)
+      return 1;
+  }
+}
+
+#define SLOT_OPEN      0
+#define SLOT_EHDR      1
+#define SLOT_SHDRS     2
+#define SLOT_SECTION   3
+#define SLOT_WRITE     4
+#define SLOT_FADVISE   5
+#define SLOT_CLOSE     6
+
+struct slot
+{
+  struct batch_file* file;   // NULL when the slot is free
+  int state;
+  int fd;
+  int noatime;
+  int ret;
+  FILE* out;
+  size_t* output_size;
+  
+  union
+  {
+    uint8_t ehdr[ARMATTR_EHDR_SIZE];
+    char magic[SARMAG];
+  } head;
+  struct armattr_elf elf;
+  uint8_t* shdrs;
+  int next_shdr;             // scanning backwards from here
+  unsigned char* section;
+  struct armattr_section section_shdr;
+  
+  struct parse_state parse;
+  int next_patch;
+  struct timespec times[2];
+  int saved;
+};
+
+void slot_queue_open(struct uring* ring, struct slot* slot, const struct options* opts)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = slot->file->dirfd;
+  sqe->addr = (uintptr_t)slot->file->name;
+  sqe->open_flags = patching(opts) ? O_RDWR : (O_RDONLY | (slot->noatime ? O_NOATIME : 0));
+  sqe->user_data = (uintptr_t)slot;
+  slot->state = SLOT_OPEN;
+}
+
+void slot_queue_rw(struct uring* ring, struct slot* slot, int opcode, void* buf, size_t len, off_t offset, int state)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  sqe->opcode = opcode;
+  sqe->fd = slot->fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = (uintptr_t)slot;
+  slot->state = state;
+}
+
+/* Finishes with the file: drops it from the page cache if it was only
+   read, then closes it. */
+void slot_queue_close(struct uring* ring, struct slot* slot, const struct options* opts)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  sqe->fd = slot->fd;
+  sqe->user_data = (uintptr_t)slot;
+  if (!patching(opts) && slot->state != SLOT_FADVISE)
+  {
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fadvise_advice = POSIX_FADV_DONTNEED;
+    slot->state = SLOT_FADVISE;
+  }
+  else
+  {
+    sqe->opcode = IORING_OP_CLOSE;
+    slot->state = SLOT_CLOSE;
+  }
+}
+
+/* Queues the read of the next attributes section, the patch writes
+   once there are no more, or the close once there is nothing to
+   write. */
+void slot_queue_next(struct uring* ring, struct slot* slot, const struct options* opts)
+{
+  if (slot->ret == 0 && !slot->parse.done)
+  {
+    struct armattr_section* shdr = &slot->section_shdr;
+    if (armattr_next_section(&slot->elf, slot->shdrs, &slot->next_shdr, shdr) > 0)
+    {
+      free(slot->section);
+      slot->section = NULL;
+      if (shdr->size < 1)
+        report("Error: Empty ARM attributes section.\n");
+      else if ((slot->section = malloc(shdr->size)) == NULL)
+        report_error("allocating attributes section");
+      else
+      {
+        slot_queue_rw(ring, slot, IORING_OP_READ, slot->section, shdr->size, shdr->offset, SLOT_SECTION);
+        return;
+      }
+      slot->ret = 1;
+    }
+  }
+  
+  if (slot->ret == 0 && slot->state != SLOT_WRITE)
+  {
+    parse_state_finish(&slot->parse);
+    slot->saved = (slot->parse.plan.npatches > 0) && save_timestamps(slot->fd, opts, slot->times);
+  }
+  
+  if (slot->ret == 0 && slot->next_patch < slot->parse.plan.npatches)
+  {
+    struct armattr_patch* patch = &slot->parse.plan.patches[slot->next_patch++];
+    slot_queue_rw(ring, slot, IORING_OP_WRITE, slot->parse.plan.data + patch->data, patch->len, patch->offset, SLOT_WRITE);
+    return;
+  }
+  
+  if (slot->saved && slot->next_patch > 0 && restore_timestamps(slot->fd, slot->times) != 0)
+    slot->ret = 1;
+  
+  slot_queue_close(ring, slot, opts);
+}
+
+/* Checks the result of a read or write of 'len' bytes. */
+int slot_check_io(int res, size_t len, const char* what)
+{
+  if (res >= 0 && (size_t)res == len)
+    return 0;
+  errno = res < 0 ? -res : EIO;
+  report_error(what);
+  return 1;
+}
+
+void slot_release(struct slot* slot)
+{
+  fclose(slot->out);
+  slot->file->ret = slot->ret;
+  free(slot->shdrs);
+  free(slot->section);
+  parse_state_free(&slot->parse);
+  slot->file = NULL;
+}
+
+/* Processes the file synchronously instead, when the kernel doesn't
+   support one of the opcodes: whatever was printed for it so far is
+   dropped, and it is opened again. */
+int slot_fallback(struct slot* slot, const struct options* opts)
+{
+  if (slot->state != SLOT_OPEN)
+    close(slot->fd);
+  fclose(slot->out);
+  free(slot->file->output);
+  slot->file->output = NULL;
+  slot->out = open_memstream(&slot->file->output, &slot->file->output_size);
+  if (slot->out == NULL)
+  {
+    perror("allocating output");
+    exit(1);
+  }
+  report_stream = slot->out;
+  slot->ret = process_at(slot->file->dirfd, slot->file->name, slot->file->display, opts);
+  return 1;
+}
+
+/* Handles the completion of a slot's request and queues its next one.
+   Returns nonzero once the slot is done with its file. */
+int slot_complete(struct uring* ring, struct slot* slot, int res, const struct options* opts)
+{
+  // opcode not supported by this kernel; not after the first write
+  // though, which shows that writes are
+  if ((res == -EINVAL || res == -EOPNOTSUPP) && slot->state != SLOT_FADVISE && slot->state != SLOT_CLOSE &&
+      (slot->state != SLOT_WRITE || slot->next_patch == 1))
+    return slot_fallback(slot, opts);
+  
+  switch (slot->state)
+  {
+    case SLOT_OPEN:
+      if (res == -EPERM && slot->noatime)
+      {
+        // O_NOATIME needs ownership
+        slot->noatime = 0;
+        slot_queue_open(ring, slot, opts);
+        return 0;
+      }
+      if (res < 0)
+      {
+        report_file(slot->file->display, NULL);
+        errno = -res;
+        report_error("opening file");
+        slot->ret = 1;
+        return 1;
+      }
+      slot->fd = res;
+      slot_queue_rw(ring, slot, IORING_OP_READ, &slot->head, sizeof(slot->head), 0, SLOT_EHDR);
+      return 0;
+      
+    case SLOT_EHDR:
+      if (res >= SARMAG && (memcmp(slot->head.magic, ARMAG, SARMAG) == 0 || memcmp(slot->head.magic, THINMAG, SARMAG) == 0))
+      {
+        // archives are left to the synchronous code
+        close(slot->fd);
+        slot->ret = process_at(slot->file->dirfd, slot->file->name, slot->file->display, opts);
+        return 1;
+      }
+      report_file(slot->file->display, NULL);
+      if (res < 0)
+        errno = -res;
+      if (read_ehdr(slot->head.ehdr, res, &slot->elf) != 0)
+      {
+        slot->ret = 1;
+        slot_queue_close(ring, slot, opts);
+        return 0;
+      }
+      size_t shtab_size = (size_t)slot->elf.shnum * slot->elf.shentsize;
+      slot->shdrs = malloc(shtab_size ? shtab_size : 1);
+      if (slot->shdrs == NULL)
+      {
+        report_error("allocating section header table");
+        slot->ret = 1;
+        slot_queue_close(ring, slot, opts);
+        return 0;
+      }
+      slot_queue_rw(ring, slot, IORING_OP_READ, slot->shdrs, shtab_size, slot->elf.shoff, SLOT_SHDRS);
+      return 0;
+      
+    case SLOT_SHDRS:
+      if (slot_check_io(res, (size_t)slot->elf.shnum * slot->elf.shentsize, "reading section header table") != 0)
+        slot->ret = 1;
+      slot->next_shdr = -1;
+      slot_queue_next(ring, slot, opts);
+      return 0;
+      
+    case SLOT_SECTION:
+      slot->parse.elf = &slot->elf;
+      slot->parse.size_field = slot->section_shdr.size_field;
+      if (slot_check_io(res, slot->section_shdr.size, "reading attributes section") != 0 ||
+          parse_eabi_attr_data(slot->section, slot->section_shdr.offset, slot->section_shdr.size, &slot->parse) != 0)
+        slot->ret = 1;
+      slot_queue_next(ring, slot, opts);
+      return 0;
+      
+    case SLOT_WRITE:
+      if (slot_check_io(res, slot->parse.plan.patches[slot->next_patch - 1].len, "patching") != 0)
+        slot->ret = 1;
+      else
+        ++patch_count;
+      slot_queue_next(ring, slot, opts);
+      return 0;
+      
+    case SLOT_FADVISE:
+      // advice is best effort
+      slot_queue_close(ring, slot, opts);
+      return 0;
+      
+    case SLOT_CLOSE:
+      // without IORING_OP_CLOSE, the descriptor is still open
+      if (res == -EINVAL || res == -EOPNOTSUPP)
+        close(slot->fd);
+      return 1;
+      
+    default:
+      return 1;
+  }
+}
+
+/* Processes 'files' with the io_uring engine, filling in their output
+   and status. Returns nonzero if any file failed. */
+int process_batch(struct batch_file* files, size_t nfiles, const struct options* opts)
+{
+  // files in the scan index need no reads to overlap, and the others
+  // have to be recorded
+  struct uring ring;
+  if (scan_index.enabled || uring_init(&ring, URING_DEPTH) != 0)
+    return process_batch_sync(files, nfiles, opts);
+  
+  struct slot slots[URING_DEPTH];
+  size_t next_file = 0;
+  int in_flight = 0;
+  
+  memset(slots, 0, sizeof(slots));
+  
+  while (next_file < nfiles || in_flight > 0)
+  {
+    // start files in all free slots
+    for (int i=0; i<URING_DEPTH && next_file < nfiles; ++i)
+    {
+      struct slot* slot = &slots[i];
+      if (slot->file != NULL)
+        continue;
+      
+      memset(slot, 0, sizeof(*slot));
+      slot->file = &files[next_file++];
+      slot->out = open_memstream(&slot->file->output, &slot->file->output_size);
+      if (slot->out == NULL)
+      {
+        perror("allocating output");
+        exit(1);
+      }
+      parse_state_init(&slot->parse, opts);
+      slot->noatime = 1;
+      slot_queue_open(&ring, slot, opts);
+      ++in_flight;
+    }
+    
+    if (uring_submit_and_wait(&ring) != 0)
+    {
+      perror("io_uring_enter");
+      exit(1);
+    }
+    
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+      const struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+      struct slot* slot = (struct slot*)(uintptr_t)cqe->user_data;
+      
+      report_stream = slot->out;
+      report_path = slot->file->display;
+      report_member = NULL;
+      int done = slot_complete(&ring, slot, cqe->res, opts);
+      report_stream = NULL;
+      
+      if (done)
+      {
+        slot_release(slot);
+        --in_flight;
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  
+  uring_free(&ring);
+  
+  int ret = 0;
+  for (size_t i=0; i<nfiles; ++i)
+  {
+    if (files[i].ret != 0)
+      ret = 1;
+  }
+  return ret;
+}
+
+#else
+
+int process_batch(struct batch_file* files, size_t nfiles, const struct options* opts)
+{
+  return process_batch_sync(files, nfiles, opts);
+}
+
+#endif
+
+/* Physical-layout ordering (--physical-order). On rotational disks,
+   visiting files in directory order makes the head jump back and forth
+   across the platter, so batches are sorted by where each file's data
+   starts on disk, as reported by FIEMAP. Filesystems without FIEMAP
+   fall back to the inode number, which on most of them roughly follows
+   allocation order; those files go after the mapped ones. */
+
+/* Distance within which the next file counts as a sequential read
+   rather than a seek. */
+#define SEEK_SPAN (1024 * 1024)
+
+struct layout
+{
+  int mapped;                // 'pos' is a physical byte offset, not an inode
+  unsigned long long pos;
+  struct batch_file file;
+};
+
+/* Finds where the data of 'name' starts on disk. Returns 1 if it was
+   found by FIEMAP, 0 if only the inode number is known, and -1 if the
+   file can't be opened (the error is reported when it is processed). */
+int physical_position(const char* name, unsigned long long* pos)
+{
+  int fd = open(name, O_RDONLY | O_NOATIME);
+  if (fd == -1 && errno == EPERM)
+    fd = open(name, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  
+  union
+  {
+    struct fiemap map;
+    char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+  } u;
+  memset(&u, 0, sizeof(u));
+  u.map.fm_length = FIEMAP_MAX_OFFSET;
+  u.map.fm_extent_count = 1;
+  
+  int ret = 0;
+  const struct fiemap_extent* extent = &u.map.fm_extents[0];
+  if (ioctl(fd, FS_IOC_FIEMAP, &u.map) == 0 && u.map.fm_mapped_extents == 1 &&
+      !(extent->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED)))
+  {
+    *pos = extent->fe_physical;
+    ret = 1;
+  }
+  else
+  {
+    struct stat st;
+    *pos = fstat(fd, &st) == 0 ? st.st_ino : 0;
+  }
+  
+  close(fd);
+  return ret;
+}
+
+int compare_layout(const void* a, const void* b)
+{
+  const struct layout* la = a;
+  const struct layout* lb = b;
+  if (la->mapped != lb->mapped)
+    return lb->mapped - la->mapped;
+  if (la->pos != lb->pos)
+    return la->pos < lb->pos ? -1 : 1;
+  return la->file.index < lb->file.index ? -1 : la->file.index > lb->file.index;
+}
+
+/* Counts the seeks between consecutive mapped files of 'layouts', and
+   adds up the distance the head travels. */
+unsigned long count_seeks(const struct layout* layouts, size_t n, unsigned long long* travel)
+{
+  unsigned long seeks = 0;
+  const struct layout* prev = NULL;
+  *travel = 0;
+  for (size_t i=0; i<n; ++i)
+  {
+    if (!layouts[i].mapped)
+      continue;
+    if (prev != NULL)
+    {
+      unsigned long long pos = layouts[i].pos;
+      if (pos < prev->pos || pos - prev->pos > SEEK_SPAN)
+        ++seeks;
+      *travel += pos < prev->pos ? prev->pos - pos : pos - prev->pos;
+    }
+    prev = &layouts[i];
+  }
+  return seeks;
+}
+
+/* Sorts 'files' into on-disk order, printing how many seeks that saves
+   over the order they were given in. */
+void order_physical(struct batch_file* files, size_t nfiles)
+{
+  if (nfiles < 2)
+    return;
+  
+  struct layout* layouts = malloc(nfiles * sizeof(*layouts));
+  if (layouts == NULL)
+  {
+    perror("allocating file layout");
+    return;
+  }
+  
+  size_t nmapped = 0;
+  for (size_t i=0; i<nfiles; ++i)
+  {
+    layouts[i].file = files[i];
+    layouts[i].mapped = physical_position(files[i].name, &layouts[i].pos) == 1;
+    nmapped += layouts[i].mapped;
+  }
+  
+  unsigned long long before_travel, after_travel;
+  unsigned long before = count_seeks(layouts, nfiles, &before_travel);
+  qsort(layouts, nfiles, sizeof(*layouts), compare_layout);
+  unsigned long after = count_seeks(layouts, nfiles, &after_travel);
+  
+  for (size_t i=0; i<nfiles; ++i)
+    files[i] = layouts[i].file;
+  free(layouts);
+  
+  fprintf(stderr, "Physical order: %lu seeks (%llu MB of head travel) instead of %lu (%llu MB) in directory order; %zu of %zu files located by FIEMAP.\n",
+          after, after_travel >> 20, before, before_travel >> 20, nmapped, nfiles);
+}
+
+int compare_batch_index(const void* a, const void* b)
+{
+  const struct batch_file* fa = a;
+  const struct batch_file* fb = b;
+  return fa->index < fb->index ? -1 : fa->index > fb->index;
+}
+
+/* Rule files describe which files to process under each root of a
+   recursive walk, replacing long find(1) expressions:
+
+     # comment
+     [platforms]
+     kind .o .so .a
+     include arch-arm/usr/lib/lib?*.so
+     exclude libcrystax.so libstdc++.so
+
+   'include' and 'exclude' take globs ('*', '?' and '[...]'). A glob
+   containing '/' is matched against the path relative to the root, in
+   which '*' also matches '/' (like find -path); otherwise it is matched
+   against the file name (like find -name). A file must match one of the
+   section's includes, if there are any, and none of its excludes.
+   The section '[*]' applies to roots that have no section of their own.
+
+   All sections are compiled together: globs without wildcards go into
+   hash sets, and all real globs into one bit-parallel automaton which
+   is run once per file over its relative path. */
+
+#define KIND_O   1
+#define KIND_SO  2
+#define KIND_A   4
+
+/* An open-addressing hash set of strings. */
+struct name_set
+{
+  char** slots;
+  size_t capacity;  // power of two
+  size_t count;
+};
+
+uint32_t hash_string(const char* s, size_t len)
+{
+  uint32_t h = 2166136261u; // FNV-1a
+  for (size_t i=0; i<len; ++i)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+int name_set_contains(const struct name_set* set, const char* s, size_t len)
+{
+  if (set->count == 0)
+    return 0;
+  
+  for (size_t i = hash_string(s, len) & (set->capacity - 1); set->slots[i] != NULL; i = (i + 1) & (set->capacity - 1))
+  {
+    if (strncmp(set->slots[i], s, len) == 0 && set->slots[i][len] == '\0')
+      return 1;
+  }
+  return 0;
+}
+
+int name_set_add(struct name_set* set, const char* s)
+{
+  if ((set->count + 1) * 2 > set->capacity)
+  {
+    struct name_set grown;
+    grown.capacity = set->capacity ? set->capacity * 2 : 16;
+    grown.count = 0;
+    grown.slots = calloc(grown.capacity, sizeof(char*));
+    if (grown.slots == NULL)
+      return 1;
+    for (size_t i=0; i<set->capacity; ++i)
+    {
+      if (set->slots[i] != NULL)
+      {
+        size_t j = hash_string(set->slots[i], strlen(set->slots[i])) & (grown.capacity - 1);
+        while (grown.slots[j] != NULL)
+          j = (j + 1) & (grown.capacity - 1);
+        grown.slots[j] = set->slots[i];
+        ++grown.count;
+      }
+    }
+    free(set->slots);
+    *set = grown;
+  }
+  
+  size_t len = strlen(s);
+  if (name_set_contains(set, s, len))
+    return 0;
+  
+  size_t i = hash_string(s, len) & (set->capacity - 1);
+  while (set->slots[i] != NULL)
+    i = (i + 1) & (set->capacity - 1);
+  set->slots[i] = strdup(s);
+  if (set->slots[i] == NULL)
+    return 1;
+  ++set->count;
+  return 0;
+}
+
+void name_set_free(struct name_set* set)
+{
+  for (size_t i=0; i<set->capacity; ++i)
+    free(set->slots[i]);
+  free(set->slots);
+}
+
+/* A set of globs compiled into one NFA, simulated with bitsets
+   (Shift-And extended with stars). Each glob of n tokens owns n+1
+   consecutive bits; bit i set means "ready to match token i", and
+   the last bit means the glob has matched. Inputs are fed with a
+   leading '/', and globs are anchored accordingly: "/path/glob" for
+   path globs and "*" + "/name-glob" for name globs. */
+struct glob_set
+{
+  size_t nbits;
+  size_t nwords;
+  uint64_t* match;      // [256][nwords]: tokens that consume c and advance
+  uint64_t* stay;       // [256][nwords]: stars that consume c and stay
+  uint64_t* star;       // [nwords]: all star tokens, for epsilon moves
+  uint64_t* start;      // [nwords]
+  uint64_t* end;        // [nwords]
+  int* end_glob;        // bit -> glob index, -1 unless an end bit
+  int* bit_glob;        // bit -> glob index
+  
+  // globs collected before compilation
+  char** globs;
+  int nglobs;
+};
+
+int glob_has_wildcards(const char* glob)
+{
+  return strpbrk(glob, "*?[") != NULL;
+}
+
+/* Adds a glob and returns its index, or -1 on allocation failure. */
+int glob_set_add(struct glob_set* set, const char* glob)
+{
+  char** globs = realloc(set->globs, (set->nglobs + 1) * sizeof(char*));
+  if (globs == NULL)
+    return -1;
+  set->globs = globs;
+  set->globs[set->nglobs] = strdup(glob);
+  if (set->globs[set->nglobs] == NULL)
+    return -1;
+  return set->nglobs++;
+}
+
+/* Parses a glob token at 'p' into a 256-entry accept table. Returns
+   the length of the token, with '*' reported through 'is_star'. */
+size_t glob_token(const char* p, unsigned char accept[256], int* is_star)
+{
+  *is_star = 0;
+  if (*p == '*')
+  {
+    *is_star = 1;
+    memset(accept, 1, 256);
+    return 1;
+  }
+  if (*p == '?')
+  {
+    memset(accept, 1, 256);
+    return 1;
+  }
+  if (*p == '[')
+  {
+    const char* q = p + 1;
+    int negate = (*q == '!' || *q == '^');
+    if (negate)
+      ++q;
+    memset(accept, 0, 256);
+    // a leading ']' is a literal
+    const char* first = q;
+    while (*q != '\0' && (*q != ']' || q == first))
+    {
+      unsigned char lo = *q, hi = *q;
+      if (q[1] == '-' && q[2] != '\0' && q[2] != ']')
+      {
+        hi = q[2];
+        q += 2;
+      }
+      for (int c=lo; c<=hi; ++c)
+        accept[c] = 1;
+      ++q;
+    }
+    if (*q == ']')
+    {
+      if (negate)
+      {
+        for (int c=0; c<256; ++c)
+          accept[c] = !accept[c];
+      }
+      return q + 1 - p;
+    }
+    // unterminated: treat '[' as a literal
+  }
+  memset(accept, 0, 256);
+  accept[(unsigned char)*p] = 1;
+  return 1;
+}
+
+/* Compiles the collected globs. 'name_glob[i]' tells whether glob i
+   applies to the file name rather than the relative path. */
+int glob_set_compile(struct glob_set* set, const int* name_glob)
+{
+  // count tokens: anchors add "/" (and "*" for name globs)
+  size_t nbits = 0;
+  for (int g=0; g<set->nglobs; ++g)
+  {
+    unsigned char accept[256];
+    int is_star;
+    size_t ntokens = name_glob[g] ? 2 : 1;
+    for (const char* p = set->globs[g]; *p != '\0'; p += glob_token(p, accept, &is_star))
+      ++ntokens;
+    nbits += ntokens + 1;
+  }
+  
+  set->nbits = nbits;
+  set->nwords = (nbits + 63) / 64;
+  if (set->nwords == 0)
+    return 0;
+  set->match = calloc(256 * set->nwords, sizeof(uint64_t));
+  set->stay = calloc(256 * set->nwords, sizeof(uint64_t));
+  set->star = calloc(set->nwords, sizeof(uint64_t));
+  set->start = calloc(set->nwords, sizeof(uint64_t));
+  set->end = calloc(set->nwords, sizeof(uint64_t));
+  set->end_glob = malloc(nbits * sizeof(int));
+  set->bit_glob = malloc(nbits * sizeof(int));
+  if (!set->match || !set->stay || !set->star || !set->start || !set->end || !set->end_glob || !set->bit_glob)
+    return 1;
+  
+  size_t bit = 0;
+  for (int g=0; g<set->nglobs; ++g)
+  {
+    set->start[bit / 64] |= 1ull << (bit % 64);
+    
+    // a name glob is "*/" + glob with a '*' that does not cross '/';
+    // a path glob is "/" + glob
+    char anchored[4096];
+    snprintf(anchored, sizeof(anchored), "%s/%s", name_glob[g] ? "*" : "", set->globs[g]);
+    
+    const char* p = anchored;
+    while (*p != '\0')
+    {
+      unsigned char accept[256];
+      int is_star;
+      size_t len = glob_token(p, accept, &is_star);
+      if (name_glob[g] && p >= anchored + 2)
+        accept['/'] = 0;
+      for (int c=0; c<256; ++c)
+      {
+        if (accept[c])
+          (is_star ? set->stay : set->match)[c * set->nwords + bit / 64] |= 1ull << (bit % 64);
+      }
+      if (is_star)
+        set->star[bit / 64] |= 1ull << (bit % 64);
+      set->end_glob[bit] = -1;
+      set->bit_glob[bit] = g;
+      p += len;
+      ++bit;
+    }
+    
+    set->end[bit / 64] |= 1ull << (bit % 64);
+    set->end_glob[bit] = g;
+    set->bit_glob[bit] = g;
+    ++bit;
+  }
+  
+  return 0;
+}
+
+/* Moves every ready star to the token after it, repeatedly. */
+void glob_closure(const struct glob_set* set, uint64_t* state)
+{
+  int changed;
+  do
+  {
+    changed = 0;
+    uint64_t carry = 0;
+    for (size_t w=0; w<set->nwords; ++w)
+    {
+      uint64_t s = state[w] & set->star[w];
+      uint64_t next = state[w] | (s << 1) | carry;
+      carry = s >> 63;
+      if (next != state[w])
+      {
+        state[w] = next;
+        changed = 1;
+      }
+    }
+  } while (changed);
+}
+
+/* Feeds one input character to the automaton. */
+void glob_step(const struct glob_set* set, uint64_t* state, unsigned char c)
+{
+  const uint64_t* match = set->match + c * set->nwords;
+  const uint64_t* stay = set->stay + c * set->nwords;
+  uint64_t carry = 0;
+  for (size_t w=0; w<set->nwords; ++w)
+  {
+    uint64_t advance = state[w] & match[w];
+    uint64_t next = (advance << 1) | carry | (state[w] & stay[w]);
+    carry = advance >> 63;
+    state[w] = next;
+  }
+  glob_closure(set, state);
+}
+
+/* Runs the automaton over "/" + 'path'. On return, 'state' has the
+   bits of all tokens the globs are ready to match next set. */
+void glob_set_run(const struct glob_set* set, const char* path, uint64_t* state)
+{
+  memcpy(state, set->start, set->nwords * sizeof(uint64_t));
+  glob_closure(set, state);
+  
+  glob_step(set, state, '/');
+  for (const char* p = path; *p != '\0'; ++p)
+    glob_step(set, state, *p);
+}
+
+/* Runs the automaton over "/" + 'path'. On return, 'state' has the end
+   bits of all matching globs set. */
+void glob_set_match(const struct glob_set* set, const char* path, uint64_t* state)
+{
+  glob_set_run(set, path, state);
+  for (size_t w=0; w<set->nwords; ++w)
+    state[w] &= set->end[w];
+}
+
+struct rule_section
+{
+  char* root;
+  int kinds;
+  int has_includes;
+  int has_name_includes;         // which can match in any directory
+  struct name_set include_names;
+  struct name_set include_paths;
+  struct name_set include_dirs;  // directories on the way to include_paths
+  struct name_set exclude_names;
+  struct name_set exclude_paths;
+};
+
+struct rules
+{
+  struct rule_section* sections;
+  int nsections;
+  
+  struct glob_set globs;
+  int* glob_section;   // glob -> section index
+  int* glob_exclude;   // glob -> nonzero for excludes
+  int* glob_is_name;   // glob -> nonzero for file name globs
+};
+
+/* Returns the KIND_* of a file name, or 0 if we don't handle it. */
+int file_kind(const char* name)
+{
+  size_t len = strlen(name);
+  if (len > 2 && strcmp(name + len - 2, ".o") == 0)
+    return KIND_O;
+  if (len > 3 && strcmp(name + len - 3, ".so") == 0)
+    return KIND_SO;
+  if (len > 2 && strcmp(name + len - 2, ".a") == 0)
+    return KIND_A;
+  return 0;
+}
+
+/* Adds an include or exclude pattern to the last section. */
+int rules_add_pattern(struct rules* rules, const char* pattern, int exclude)
+{
+  int section = rules->nsections - 1;
+  struct rule_section* rs = &rules->sections[section];
+  int is_name = (strchr(pattern, '/') == NULL);
+  
+  if (!exclude)
+    rs->has_includes = 1;
+  if (!exclude && is_name)
+    rs->has_name_includes = 1;
+  
+  if (!glob_has_wildcards(pattern))
+  {
+    if (!exclude && !is_name)
+    {
+      char dir[PATH_MAX];
+      snprintf(dir, sizeof(dir), "%s", pattern);
+      for (char* slash = strrchr(dir, '/'); slash != NULL; slash = strrchr(dir, '/'))
+      {
+        *slash = '\0';
+        if (name_set_add(&rs->include_dirs, dir) != 0)
+          return 1;
+      }
+    }
+    struct name_set* set = exclude ?
+      (is_name ? &rs->exclude_names : &rs->exclude_paths) :
+      (is_name ? &rs->include_names : &rs->include_paths);
+    return name_set_add(set, pattern);
+  }
+  
+  int g = glob_set_add(&rules->globs, pattern);
+  if (g < 0)
+    return 1;
+  rules->glob_section = realloc(rules->glob_section, (g + 1) * sizeof(int));
+  rules->glob_exclude = realloc(rules->glob_exclude, (g + 1) * sizeof(int));
+  rules->glob_is_name = realloc(rules->glob_is_name, (g + 1) * sizeof(int));
+  if (!rules->glob_section || !rules->glob_exclude || !rules->glob_is_name)
+    return 1;
+  rules->glob_section[g] = section;
+  rules->glob_exclude[g] = exclude;
+  rules->glob_is_name[g] = is_name;
+  return 0;
+}
+
+/* Loads and compiles a rule file. */
+int rules_load(const char* filename, struct rules* rules)
+{
+  memset(rules, 0, sizeof(*rules));
+  
+  FILE* file = fopen(filename, "r");
+  if (file == NULL)
+  {
+    report_error(filename);
+    return 1;
+  }
+  
+  char* line = NULL;
+  size_t line_size = 0;
+  int lineno = 0;
+  int ret = 0;
+  
+  while (ret == 0 && getline(&line, &line_size, file) != -1)
+  {
+    ++lineno;
+    
+    char* comment = strchr(line, '#');
+    if (comment != NULL)
+      *comment = '\0';
+    
+    char* save;
+    char* word = strtok_r(line, " \t\r\n", &save);
+    if (word == NULL)
+      continue;
+    
+    if (word[0] == '[')
+    {
+      char* close = strchr(word, ']');
+      if (close == NULL || close[1] != '\0' || strtok_r(NULL, " \t\r\n", &save) != NULL)
+      {
+        printf("Error: %s:%d: Malformed section header.\n", filename, lineno);
+        ret = 1;
+        break;
+      }
+      *close = '\0';
+      
+      struct rule_section* sections = realloc(rules->sections, (rules->nsections + 1) * sizeof(*sections));
+      if (sections == NULL)
+      {
+        report_error("allocating rules");
+        ret = 1;
+        break;
+      }
+      rules->sections = sections;
+      struct rule_section* rs = &rules->sections[rules->nsections++];
+      memset(rs, 0, sizeof(*rs));
+      rs->root = strdup(word + 1);
+      rs->kinds = KIND_O | KIND_SO | KIND_A;
+      continue;
+    }
+    
+    if (rules->nsections == 0)
+    {
+      printf("Error: %s:%d: '%s' outside of a [root] section.\n", filename, lineno, word);
+      ret = 1;
+      break;
+    }
+    
+    int directive;
+    if (strcmp(word, "kind") == 0)
+    {
+      directive = 0;
+      rules->sections[rules->nsections - 1].kinds = 0;
+    }
+    else if (strcmp(word, "include") == 0)
+      directive = 1;
+    else if (strcmp(word, "exclude") == 0)
+      directive = 2;
+    else
+    {
+      printf("Error: %s:%d: Unknown directive '%s'.\n", filename, lineno, word);
+      ret = 1;
+      break;
+    }
+    
+    while (ret == 0 && (word = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+    {
+      if (directive == 0)
+      {
+        int kind = strcmp(word, ".o") == 0 ? KIND_O :
+                   strcmp(word, ".so") == 0 ? KIND_SO :
+                   strcmp(word, ".a") == 0 ? KIND_A : 0;
+        if (kind == 0)
+        {
+          printf("Error: %s:%d: Unknown file kind '%s'.\n", filename, lineno, word);
+          ret = 1;
+        }
+        rules->sections[rules->nsections - 1].kinds |= kind;
+      }
+      else if (rules_add_pattern(rules, word, directive == 2) != 0)
+      {
+        report_error("allocating rules");
+        ret = 1;
+      }
+    }
+  }
+  
+  free(line);
+  fclose(file);
+  
+  if (ret == 0 && glob_set_compile(&rules->globs, rules->glob_is_name) != 0)
+  {
+    report_error("compiling rules");
+    ret = 1;
+  }
+  
+  return ret;
+}
+
+/* Finds the section for a root, falling back to '[*]'. */
+const struct rule_section* rules_find_section(const struct rules* rules, const char* root)
+{
+  const struct rule_section* fallback = NULL;
+  for (int i=0; i<rules->nsections; ++i)
+  {
+    if (strcmp(rules->sections[i].root, root) == 0)
+      return &rules->sections[i];
+    if (strcmp(rules->sections[i].root, "*") == 0)
+      fallback = &rules->sections[i];
+  }
+  return fallback;
+}
+
+/* Decides whether a file is to be processed. 'path' is relative to the
+   root of 'rs' and 'name' is its last component. */
+int rules_match(const struct rules* rules, const struct rule_section* rs, const char* path, const char* name)
+{
+  if ((rs->kinds & file_kind(name)) == 0)
+    return 0;
+  
+  size_t name_len = strlen(name);
+  size_t path_len = strlen(path);
+  if (name_set_contains(&rs->exclude_names, name, name_len) ||
+      name_set_contains(&rs->exclude_paths, path, path_len))
+    return 0;
+  
+  int included = !rs->has_includes ||
+    name_set_contains(&rs->include_names, name, name_len) ||
+    name_set_contains(&rs->include_paths, path, path_len);
+  
+  const struct glob_set* globs = &rules->globs;
+  if (globs->nwords == 0)
+    return included;
+  
+  uint64_t state[globs->nwords];
+  glob_set_match(globs, path, state);
+  
+  int section = rs - rules->sections;
+  for (size_t w=0; w<globs->nwords; ++w)
+  {
+    for (uint64_t bits = state[w]; bits != 0; bits &= bits - 1)
+    {
+      int g = globs->end_glob[w * 64 + __builtin_ctzll(bits)];
+      if (rules->glob_section[g] != section)
+        continue;
+      if (rules->glob_exclude[g])
+        return 0;
+      included = 1;
+    }
+  }
+  
+  return included;
+}
+
+/* Decides whether a directory is to be walked, that is whether a file
+   under it can still match: not if the section has includes and none
+   of them can match below it, or if an exclude matches everything
+   below it, like a path exclude ending in a star. 'path' is relative
+   to the root of 'rs'. */
+int rules_match_dir(const struct rules* rules, const struct rule_section* rs, const char* path)
+{
+  const struct glob_set* globs = &rules->globs;
+  int included = !rs->has_includes || rs->has_name_includes ||
+    name_set_contains(&rs->include_dirs, path, strlen(path));
+  if (globs->nwords == 0)
+    return included;
+  
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/", path);
+  uint64_t state[globs->nwords];
+  glob_set_run(globs, dir, state);
+  
+  int section = rs - rules->sections;
+  for (size_t w=0; w<globs->nwords; ++w)
+  {
+    for (uint64_t bits = state[w]; bits != 0; bits &= bits - 1)
+    {
+      size_t bit = w * 64 + __builtin_ctzll(bits);
+      int g = globs->bit_glob[bit];
+      if (rules->glob_section[g] != section)
+        continue;
+      if (!rules->glob_exclude[g])
+        included = 1;
+      else if (!rules->glob_is_name[g] && globs->end_glob[bit + 1] == g &&
+               (globs->star[bit / 64] & (1ull << (bit % 64))))
+        return 0;     // a trailing '*' of a path exclude, which crosses '/'
+    }
+  }
+  
+  return included;
+}
+
+/* Recursive mode: directory trees are walked and their ELF files
+   processed by a pool of worker threads. Directories, files and archive
+   members are all tasks on one shared stack; a directory task enqueues
+   its children, and an archive file task enqueues one task per member,
+   all sharing the archive's descriptor through pread()/pwrite().
+   Entries are opened with openat() relative to their parent directory,
+   which stays open for as long as any child task refers to it. */
+
+/* A reference-counted descriptor of a directory or an archive. */
+struct fd_ref
+{
+  int fd;
+  int refs;
+  int patched;                 // a member task wrote to it
+  int preserve;                // restore 'times' once patched
+  struct timespec times[2];
+  const struct options* opts;  // for archives opened by open_input()
+};
+
+#define TASK_DIR     0
+#define TASK_FILE    1
+#define TASK_MEMBER  2
+
+struct task
+{
+  struct task* next;
+  struct fd_ref* parent;   // directory 'name' is relative to
+  char* path;              // full path, for display and ordering
+  const char* name;        // last component of 'path'
+  size_t rel_offset;       // where the path below the root starts
+  const struct rule_section* section;  // rules for this root, or NULL
+  int kind;
+  
+  // for TASK_MEMBER
+  struct fd_ref* archive;
+  struct ar_member* member;
+  int thin;
+};
+
+struct result
+{
+  char* path;
+  int member;              // member index, or -1 for the file itself
+  char* output;
+  int ret;
+};
+
+struct walk
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct task* stack;
+  int pending;             // tasks queued or running
+  
+  struct result* results;
+  size_t nresults;
+  size_t results_cap;
+  int ret;
+  
+  const struct rules* rules;
+  const struct options* opts;
+  
+  // with --io-uring, files are only collected during the walk
+  struct batch_file* deferred;
+  size_t ndeferred;
+  size_t deferred_cap;
+};
+
+struct fd_ref* fd_ref_new(int fd)
+{
+  struct fd_ref* ref = malloc(sizeof(*ref));
+  if (ref == NULL)
+  {
+    perror("allocating descriptor");
+    exit(1);
+  }
+  ref->fd = fd;
+  ref->refs = 1;
+  ref->patched = 0;
+  ref->preserve = 0;
+  ref->opts = NULL;
+  return ref;
+}
+
+void fd_ref_release(struct walk* walk, struct fd_ref* ref)
+{
+  if (ref == NULL)
+    return;
+  
+  pthread_mutex_lock(&walk->lock);
+  int refs = --ref->refs;
+  pthread_mutex_unlock(&walk->lock);
+  
+  if (refs == 0)
+  {
+    // archive members are patched by several tasks; the timestamps
+    // are put back once the last of them is done
+    if (ref->preserve && ref->patched)
+    {
+      if (futimens(ref->fd, ref->times) != 0)
+      {
+        pthread_mutex_lock(&walk->lock);
+        walk->ret = 1;
+        pthread_mutex_unlock(&walk->lock);
+        perror("restoring timestamps");
+      }
+    }
+    if (ref->opts != NULL)
+      close_input(ref->fd, ref->opts);
+    else
+      close(ref->fd);
+    free(ref);
+  }
+}
+
+/* Queues a task; 'parent' gains a reference. Call with the lock held,
+   and finish filling in the returned task before releasing it. */
+struct task* walk_push(struct walk* walk, struct task* from, struct fd_ref* parent, char* path, size_t name_offset, int kind)
+{
+  struct task* task = malloc(sizeof(*task));
+  if (task == NULL)
+  {
+    perror("allocating task");
+    exit(1);
+  }
+  task->parent = parent;
+  task->path = path;
+  task->name = path + name_offset;
+  task->kind = kind;
+  task->archive = NULL;
+  task->member = NULL;
+  task->thin = 0;
+  task->rel_offset = from ? from->rel_offset : name_offset + strlen(task->name) + 1;
+  task->section = from ? from->section : NULL;
+  task->next = walk->stack;
+  walk->stack = task;
+  ++walk->pending;
+  if (parent != NULL)
+    ++parent->refs;
+  pthread_cond_signal(&walk->cond);
+  return task;
+}
+
+/* Records a task's output. Takes ownership of 'path' and 'output'. */
+void walk_add_result(struct walk* walk, char* path, int member, char* output, int ret)
+{
+  pthread_mutex_lock(&walk->lock);
+  if (walk->nresults == walk->results_cap)
+  {
+    walk->results_cap = walk->results_cap ? walk->results_cap * 2 : 256;
+    walk->results = realloc(walk->results, walk->results_cap * sizeof(*walk->results));
+    if (walk->results == NULL)
+    {
+      perror("allocating results");
+      exit(1);
+    }
+  }
+  walk->results[walk->nresults].path = path;
+  walk->results[walk->nresults].member = member;
+  walk->results[walk->nresults].output = output;
+  walk->results[walk->nresults].ret = ret;
+  ++walk->nresults;
+  if (ret != 0)
+    walk->ret = 1;
+  pthread_mutex_unlock(&walk->lock);
+}
+
+struct walk_archive_ctx
+{
+  struct walk* walk;
+  struct task* task;
+  struct fd_ref* archive;
+  int thin;
+};
+
+/* Queues a task for one archive member. */
+int walk_push_member(void* ctx, const struct ar_member* member)
+{
+  struct walk_archive_ctx* c = ctx;
+  
+  char* path = strdup(c->task->path);
+  struct ar_member* copy = malloc(sizeof(*copy));
+  if (path == NULL || copy == NULL)
+  {
+    perror("allocating member");
+    exit(1);
+  }
+  *copy = *member;
+  
+  pthread_mutex_lock(&c->walk->lock);
+  struct task* task = walk_push(c->walk, c->task, c->task->parent, path, c->task->name - c->task->path, TASK_MEMBER);
+  task->archive = c->archive;
+  task->member = copy;
+  task->thin = c->thin;
+  ++c->archive->refs;
+  pthread_mutex_unlock(&c->walk->lock);
+  
+  return 0;
+}
+
+/* Sets a file aside for process_batch(). Takes ownership of 'path'. */
+void walk_defer(struct walk* walk, char* path)
+{
+  pthread_mutex_lock(&walk->lock);
+  if (walk->ndeferred == walk->deferred_cap)
+  {
+    walk->deferred_cap = walk->deferred_cap ? walk->deferred_cap * 2 : 256;
+    walk->deferred = realloc(walk->deferred, walk->deferred_cap * sizeof(*walk->deferred));
+    if (walk->deferred == NULL)
+    {
+      perror("allocating file list");
+      exit(1);
+    }
+  }
+  struct batch_file* file = &walk->deferred[walk->ndeferred++];
+  memset(file, 0, sizeof(*file));
+  file->dirfd = AT_FDCWD;
+  file->name = path;
+  file->display = path;
+  pthread_mutex_unlock(&walk->lock);
+}
+
+/* Processes an ELF file, or splits an archive into member tasks. */
+int walk_file(struct walk* walk, struct task* task)
+{
+  int indexed = index_process(task->parent ? task->parent->fd : AT_FDCWD, task->name, task->path, walk->opts);
+  if (indexed >= 0)
+    return indexed;
+  
+  int fd = open_input(task->parent ? task->parent->fd : AT_FDCWD, task->name, walk->opts);
+  if (fd == -1)
+  {
+    report_file(task->path, NULL);
+    report_error("opening file");
+    return 1;
+  }
+  
+  struct timespec times[2];
+  int saved = save_timestamps(fd, walk->opts, times);
+  
+  struct reader reader;
+  reader_init(&reader, fd, 0, walk->opts);
+  
+  int thin;
+  int archive = is_archive(&reader, &thin);
+  if (!archive)
+  {
+    report_file(task->path, NULL);
+    unsigned long patches = patch_count;
+    int ret = parse_elf(&reader, walk->opts);
+    reader_free(&reader);
+    if (saved && patch_count != patches && restore_timestamps(fd, times) != 0)
+      ret = 1;
+    close_input(fd, walk->opts);
+    return ret;
+  }
+  
+  struct walk_archive_ctx ctx = { walk, task, fd_ref_new(fd), thin };
+  ctx.archive->opts = walk->opts;
+  if (saved)
+  {
+    ctx.archive->preserve = 1;
+    memcpy(ctx.archive->times, times, sizeof(times));
+  }
+  int ret = scan_archive(&reader, task->path, thin, walk_push_member, &ctx);
+  reader_free(&reader);
+  fd_ref_release(walk, ctx.archive);
+  return ret;
+}
+
+/* Reads a directory, queueing its subdirectories and candidate files.
+   Returns nonzero on error. */
+int walk_dir(struct walk* walk, struct task* task)
 {
-  int               shift = 0;
-  unsigned char     byte;
+  int dirfd = openat(task->parent ? task->parent->fd : AT_FDCWD, task->name, O_RDONLY | O_DIRECTORY);
+  if (dirfd == -1 && errno == ENOTDIR)
+  {
+    // a file given as a root is processed as is
+    return walk_file(walk, task);
+  }
+  if (dirfd == -1)
+  {
+    report_file(task->path, NULL);
+    report_error("opening directory");
+    return 1;
+  }
+  
+  DIR* dir = fdopendir(dup(dirfd));
+  if (dir == NULL)
+  {
+    report_file(task->path, NULL);
+    report_error("reading directory");
+    close(dirfd);
+    return 1;
+  }
+  
+  struct fd_ref* ref = fd_ref_new(dirfd);
+  
+  size_t path_len = strlen(task->path);
+  struct dirent* entry;
+  
+  // subdirectories are pushed first, so that the files of this
+  // directory are popped first and its descriptor is released early
+  for (int pass=0; pass<2; ++pass)
+  {
+    rewinddir(dir);
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        continue;
+      
+      int type = entry->d_type;
+      if (type == DT_UNKNOWN)
+      {
+        struct stat st;
+        if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+          continue;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+      }
+      
+      int is_dir = (type == DT_DIR);
+      if (is_dir != (pass == 0))
+        continue;
+      if (!is_dir && type != DT_REG)
+        continue;
+      
+      size_t name_len = strlen(entry->d_name);
+      char* path = malloc(path_len + 1 + name_len + 1);
+      if (path == NULL)
+      {
+        perror("allocating path");
+        exit(1);
+      }
+      memcpy(path, task->path, path_len);
+      path[path_len] = '/';
+      memcpy(path + path_len + 1, entry->d_name, name_len + 1);
+      
+      // directories no rule can match below aren't even opened
+      int wanted;
+      if (task->section == NULL)
+        wanted = is_dir || file_kind(entry->d_name) != 0;
+      else if (is_dir)
+        wanted = rules_match_dir(walk->rules, task->section, path + task->rel_offset);
+      else
+        wanted = rules_match(walk->rules, task->section, path + task->rel_offset, path + path_len + 1);
+      if (!wanted)
+      {
+        free(path);
+        continue;
+      }
+      
+      pthread_mutex_lock(&walk->lock);
+      walk_push(walk, task, ref, path, path_len + 1, is_dir ? TASK_DIR : TASK_FILE);
+      pthread_mutex_unlock(&walk->lock);
+    }
+  }
   
-  *result = 0;
+  closedir(dir);
+  fd_ref_release(walk, ref);
+  return 0;
+}
 
-  while (*pos < size)
+void* walk_worker(void* arg)
+{
+  struct walk* walk = arg;
+  
+  for (;;)
   {
-    if (read(fd, &byte, sizeof(byte)) != 1)
+    pthread_mutex_lock(&walk->lock);
+    while (walk->stack == NULL && walk->pending > 0)
+      pthread_cond_wait(&walk->cond, &walk->lock);
+    if (walk->stack == NULL)
+    {
+      pthread_mutex_unlock(&walk->lock);
+      return NULL;
+    }
+    struct task* task = walk->stack;
+    walk->stack = task->next;
+    pthread_mutex_unlock(&walk->lock);
+    
+    if (task->kind == TASK_FILE && (walk->opts->io_uring || walk->opts->physical_order))
+    {
+      walk_defer(walk, task->path);
+      task->path = NULL;
+      fd_ref_release(walk, task->parent);
+      free(task);
+      
+      pthread_mutex_lock(&walk->lock);
+      if (--walk->pending == 0)
+        pthread_cond_broadcast(&walk->cond);
+      pthread_mutex_unlock(&walk->lock);
+      continue;
+    }
+    
+    char* output = NULL;
+    size_t output_size = 0;
+    report_stream = open_memstream(&output, &output_size);
+    if (report_stream == NULL)
     {
-      perror("reading ULEB128");
-      return 1;
+      perror("allocating output");
+      exit(1);
     }
-    ++(*pos);
     
-    *result |= (byte & 0x7f) << shift;
-    if ((byte & 0x80) == 0)
-      break;
-      
-    if (*pos >= size)
+    unsigned long patches = patch_count;
+    int ret;
+    if (task->kind == TASK_DIR)
+      ret = walk_dir(walk, task);
+    else if (task->kind == TASK_FILE)
+      ret = walk_file(walk, task);
+    else
+      ret = process_member(task->archive->fd, NULL, task->parent ? task->parent->fd : AT_FDCWD, task->name, task->path,
+                           task->thin, task->member, walk->opts);
+    
+    fclose(report_stream);
+    report_stream = NULL;
+    
+    if (task->archive != NULL && !task->thin && patch_count != patches)
     {
-      printf("Error: Unterminated ULEB128.\n");
-      return 1;
+      pthread_mutex_lock(&walk->lock);
+      task->archive->patched = 1;
+      pthread_mutex_unlock(&walk->lock);
     }
-
-    shift += 7;
+    
+    // directories and archives only produce a line of their own
+    // if something went wrong
+    if (output_size > 0)
+      walk_add_result(walk, task->path, task->member ? task->member->index : -1, output, ret);
+    else
+    {
+      free(task->path);
+      free(output);
+    }
+    
+    fd_ref_release(walk, task->archive);
+    fd_ref_release(walk, task->parent);
+    free(task->member);
+    free(task);
+    
+    pthread_mutex_lock(&walk->lock);
+    if (--walk->pending == 0)
+      pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
   }
-  
-  return 0;
 }
 
-/* Reads an NTBS (null-terminated string) value from the file descriptor.
-
-   'pos' is the current position within the section and 'size' is the
-   size of the section. The function will take care not to run outside
-   of the section. */
-int parse_ntbs(int fd, char* result, size_t result_size, off_t* pos, size_t size)
+/* Orders results by path, then archive members by their position. */
+int compare_results(const void* a, const void* b)
 {
-  off_t i = 0;
+  const struct result* ra = a;
+  const struct result* rb = b;
+  int ret = strcmp(ra->path, rb->path);
+  if (ret != 0)
+    return ret;
+  return (ra->member > rb->member) - (ra->member < rb->member);
+}
 
-  while (*pos < size)
+/* Walks all 'roots' with 'nthreads' workers and prints the results
+   sorted by path, so that the output does not depend on scheduling. */
+int process_recursive(char** roots, int nroots, int nthreads, const struct rules* rules, const struct options* opts)
+{
+  struct walk walk;
+  memset(&walk, 0, sizeof(walk));
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.cond, NULL);
+  walk.opts = opts;
+  walk.rules = rules;
+  
+  for (int i=0; i<nroots; ++i)
   {
-    char byte;
-    if (read(fd, &byte, sizeof(byte)) != 1)
+    // strip trailing slashes so that child paths look like find's
+    size_t len = strlen(roots[i]);
+    while (len > 1 && roots[i][len-1] == '/')
+      --len;
+    char* path = strndup(roots[i], len);
+    if (path == NULL)
     {
-      perror("skipping NTBS\n");
+      perror("allocating path");
       return 1;
     }
-    ++(*pos);
-    
-    if ((result != NULL) && (i < result_size))
-    {
-      result[i] = byte;
-    }
-    ++i;
-    
-    if (byte == 0)
-      break;
-      
-    if (*pos >= size)
+    walk_push(&walk, NULL, NULL, path, 0, TASK_DIR);
+    if (rules != NULL)
     {
-      printf("Error: Unterminated NTBS.\n");
-      return 1;
+      walk.stack->section = rules_find_section(rules, path);
+      if (walk.stack->section == NULL)
+        printf("Warning: No rules for %s, processing all .o, .so and .a files.\n", path);
     }
   }
   
-  // ensure null-termination
-  if (result != NULL)
+  pthread_t* threads = malloc(nthreads * sizeof(*threads));
+  if (threads == NULL)
+  {
+    perror("allocating threads");
+    return 1;
+  }
+  
+  int started = 0;
+  for (int i=0; i<nthreads; ++i)
   {
-    result[result_size-1] = '\0';
+    if (pthread_create(&threads[started], NULL, walk_worker, &walk) == 0)
+      ++started;
   }
   
-  return 0;
+  // if no thread could be created, do the work on this one
+  if (started == 0)
+    walk_worker(&walk);
+  
+  for (int i=0; i<started; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  
+  if (walk.ndeferred > 0)
+  {
+    if (opts->physical_order)
+      order_physical(walk.deferred, walk.ndeferred);
+    if (opts->io_uring)
+      process_batch(walk.deferred, walk.ndeferred, opts);
+    else
+      process_batch_sync(walk.deferred, walk.ndeferred, opts);
+    for (size_t i=0; i<walk.ndeferred; ++i)
+      walk_add_result(&walk, (char*)walk.deferred[i].name, -1, walk.deferred[i].output, walk.deferred[i].ret);
+    free(walk.deferred);
+  }
+  
+  qsort(walk.results, walk.nresults, sizeof(*walk.results), compare_results);
+  for (size_t i=0; i<walk.nresults; ++i)
+  {
+    fputs(walk.results[i].output, stdout);
+    free(walk.results[i].path);
+    free(walk.results[i].output);
+  }
+  free(walk.results);
+  
+  pthread_mutex_destroy(&walk.lock);
+  pthread_cond_destroy(&walk.cond);
+  
+  return walk.ret;
 }
 
-/* Parses the ARM attributes section's 'eabi' subsection */
-int parse_eabi_attr_aeabi_subsection(int fd, off_t* pos, size_t sh_size, char wchar_size)
+/* Appends every path listed in 'list', separated by 'delim' (either
+   '\n' or '\0' for find -print0 style lists), to 'names'. */
+int read_list(FILE* list, int delim, char*** names, size_t* nnames)
 {
-  unsigned long int attr, value;
-  int ret;
-  char buf[1024];
+  char* line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  size_t cap = *nnames;
   
-  if (sh_size < 1)
+  while ((len = getdelim(&line, &line_size, delim, list)) != -1)
   {
-    printf("Error: aeabi subsection too small.\n");
-    return 1;
+    if (len > 0 && line[len-1] == delim)
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+    
+    if (*nnames == cap)
+    {
+      cap = cap ? cap * 2 : 256;
+      char** grown = realloc(*names, cap * sizeof(char*));
+      if (grown == NULL)
+      {
+        perror("allocating file list");
+        free(line);
+        return 1;
+      }
+      *names = grown;
+    }
+    (*names)[(*nnames)++] = strdup(line);
   }
   
-  unsigned char tag;
-  if (read(fd, &tag, sizeof(tag)) != sizeof(tag))
+  free(line);
+  return 0;
+}
+
+/* Number of files opened ahead of the one being processed with
+   --prefetch, so that their first blocks are already on the way. */
+#define PREFETCH_AHEAD 8
+
+/* Opens the file at 'name' ahead of time and asks the kernel to start
+   reading its first block in the background. Returns -1 if it can't be
+   opened, or if the scan index answers for it without opening it; the
+   error is reported, or the index looked up, when the file's turn
+   comes. */
+int open_ahead(const char* name, const struct options* opts)
+{
+  if (index_lookup(AT_FDCWD, name, opts, NULL, NULL))
+    return -1;
+  
+  int fd = open_input(AT_FDCWD, name, opts);
+  if (fd != -1)
+    posix_fadvise(fd, 0, opts->prefetch, POSIX_FADV_WILLNEED);
+  return fd;
+}
+
+/* Processes a list of files, printing one status line per file (or
+   archive member), in order. */
+int process_names(char** names, size_t nnames, const struct options* opts)
+{
+  int ret = 0;
+  
+  int batch = opts->io_uring || opts->physical_order;
+  
+  if (!batch && opts->prefetch > 0)
   {
-    perror("reading aeabi subsection tag\n");
-    return 1;
+    int ahead[PREFETCH_AHEAD];
+    for (size_t i=0; i<nnames && i<PREFETCH_AHEAD; ++i)
+      ahead[i] = open_ahead(names[i], opts);
+    
+    for (size_t i=0; i<nnames; ++i)
+    {
+      int fd = ahead[i % PREFETCH_AHEAD];
+      if (i + PREFETCH_AHEAD < nnames)
+        ahead[i % PREFETCH_AHEAD] = open_ahead(names[i + PREFETCH_AHEAD], opts);
+      
+      // failed opens are retried to report the error in order, and
+      // files the index answers for go through it
+      int r = fd == -1 ? process(names[i], names[i], opts)
+                       : process_fd(fd, AT_FDCWD, names[i], names[i], opts);
+      if (r != 0)
+        ret = 1;
+    }
+    return ret;
   }
-  ++(*pos);
   
-  // if tag = section or tag = symbol, skip over section/symbol identifiers
-  if (tag == 2 || tag == 3)
+  if (!batch)
   {
-    unsigned long int id;
-    do
+    for (size_t i=0; i<nnames; ++i)
     {
-      ret = parse_uleb128(fd, &id, pos, sh_size);
-      if (ret != 0)
-        return ret;
-    } while (id != 0);    
+      if (process(names[i], names[i], opts) != 0)
+        ret = 1;
+    }
+    return ret;
   }
   
-  while (*pos < sh_size)
+  struct batch_file* files = calloc(nnames, sizeof(*files));
+  if (files == NULL)
   {
-    ret = parse_uleb128(fd, &attr, pos, sh_size);
-    if (ret != 0)
-      return ret;
-      
-    switch (attr)
-    {
-      case 4: // Tag_CPU_raw_name 
-      case 5: // Tag_CPU_name 
-      case 67: // Tag_conformance 
-      case 32: // Tag_compatibility
-        ret = parse_ntbs(fd, buf, sizeof(buf), pos, sh_size);
-        if (ret != 0)
-          return ret;
-        break;
-      case 18: // Tag_ABI_PCS_wchar_t
-        ret = parse_uleb128(fd, &value, pos, sh_size);
-        if (ret != 0)
-          return ret;
-        printf("Tag_ABI_PCS_wchar_t = %ld", value);
-        if (wchar_size >= 0)
-        {
-          if (value > 0x7f)
-          {
-            // This utility does not support resizing structures
-            printf("Error: Unable to patch Tag_ABI_PCS_wchar_t: old value is too big.\n");
-          }
-          if (lseek(fd, -1, SEEK_CUR) == (off_t)-1)
-          {
-            perror("seeking to patch");
-            return 1;
-          }
-          if (write(fd, &wchar_size, sizeof(wchar_size)) != sizeof(wchar_size))
-          {
-            perror("patching");
-            return 1;
-          }
-          printf(", patched to %d\n", wchar_size);
-        }
-        else
-        {
-          printf("\n");
-        }
-        break;
-      default:
-        // skip over tag -- for >32, we follow ARM's convention
-        if (attr > 32)
-        {
-          if ((attr % 2) == 0) // even
-            ret = parse_uleb128(fd, &value, pos, sh_size);
-          else // odd
-            ret = parse_ntbs(fd, NULL, 0, pos, sh_size);
-        }
-        else
-        {
-          // all NTBS tags are in the switch above; the rest are ULEB128
-          ret = parse_uleb128(fd, &value, pos, sh_size);
-        }
-        if (ret != 0)
-          return ret;
-        break;
-    }
+    perror("allocating file list");
+    return 1;
+  }
+  for (size_t i=0; i<nnames; ++i)
+  {
+    files[i].dirfd = AT_FDCWD;
+    files[i].name = names[i];
+    files[i].display = names[i];
+    files[i].index = i;
   }
   
-  return 0;
+  if (opts->physical_order)
+    order_physical(files, nnames);
+  if (opts->io_uring)
+    ret = process_batch(files, nnames, opts);
+  else
+    ret = process_batch_sync(files, nnames, opts);
+  
+  // print in the order the files were given
+  qsort(files, nnames, sizeof(*files), compare_batch_index);
+  for (size_t i=0; i<nnames; ++i)
+  {
+    fputs(files[i].output, stdout);
+    free(files[i].output);
+  }
+  free(files);
+  return ret;
 }
 
-/* Parses the ARM attributes ELF section */
-int parse_eabi_attr_section(int fd, size_t sh_size, char wchar_size)
+void usage()
 {
-  int ret;
+  printf("Syntax: arm-wchar-tag [filename] [Tag_ABI_PCS_wchar_t]\n"
+         "        arm-wchar-tag [options] [filename...]\n"
+         "\n"
+         "Options:\n"
+         "  -w, --wchar=N         patch Tag_ABI_PCS_wchar_t to N (same as --set 18=N)\n"
+         "  -s, --set=TAG=N       patch attribute TAG (a name or number) to N\n"
+         "      --if=TAG=N        only patch files whose TAG is N (all of them must hold)\n"
+         "      --remove=TAG      delete attribute TAG\n"
+         "  -p, --preserve-timestamps\n"
+         "                        keep atime and mtime of patched files\n"
+         "  -T, --files-from=F    read filenames from F ('-' for stdin)\n"
+         "  -0, --null            filenames in F are NUL-terminated\n"
+         "  -r, --recursive       walk the given directories for .o, .so and .a files\n"
+         "  -j, --jobs=N          use N worker threads in recursive mode\n"
+         "  -R, --rules=F         select files in recursive mode by the rule file F;\n"
+         "                        without directories, walk the roots named in F\n"
+         "      --io-uring        batch file I/O through io_uring (with several files)\n"
+         "      --prefetch[=KB]   read files in large speculative blocks (default 64 KB)\n"
+         "                        and open batch files ahead, for NFS and FUSE mounts\n"
+         "      --physical-order  process batches in on-disk order (for hard disks)\n"
+         "      --dump            print all attributes as NDJSON instead of patching\n"
+         "      --query=TAGS      print only the comma-separated TAGS (names or numbers)\n"
+         "      --index=F         keep what was found in the index file F, and answer\n"
+         "                        from it for files that haven't changed since\n"
+         "      --stats           report how many sections matched a known layout\n"
+         "      --filter          patch the ELF file or archive on stdin to stdout,\n"
+         "                        with status lines on stderr\n");
+}
+
+/* Sets 'tag' to 'value' in 'list', replacing an earlier value. At
+   most 64 entries are allowed, as --if conditions are tracked in a
+   bitmask. */
+int add_tag_value(struct armattr_tag_value** list, int* n, unsigned long tag, unsigned long value)
+{
+  for (int i=0; i<*n; ++i)
+  {
+    if ((*list)[i].tag == tag)
+    {
+      (*list)[i].value = value;
+      return 0;
+    }
+  }
   
-  if (sh_size < 1)
+  if (*n == 64)
+  {
+    printf("Error: Too many attributes given.\n");
+    return 1;
+  }
+  struct armattr_tag_value* grown = realloc(*list, (*n + 1) * sizeof(**list));
+  if (grown == NULL)
   {
-    printf("Error: Empty ARM attributes section.\n");
+    perror("allocating attribute list");
+    exit(1);
   }
+  *list = grown;
+  (*list)[*n].tag = tag;
+  (*list)[*n].value = value;
+  ++*n;
+  return 0;
+}
 
-  char version;
-  if (read(fd, &version, sizeof(version)) != sizeof(version))
+/* Adds a patch of attribute 'tag' to 'value' to 'opts', checking that
+   it is a numeric attribute. */
+int add_set(struct options* opts, unsigned long tag, unsigned long value)
+{
+  char buf[32];
+  const char* name = tag_string(tag, buf, sizeof(buf));
+  
+  if (tag < 4 || armattr_encoding(tag) != ARMATTR_ULEB)
   {
-    perror("reading version");
+    printf("Error: %s is not a numeric attribute.\n", name);
     return 1;
   }
   
-  if (version != 'A')
+  return add_tag_value(&opts->sets, &opts->nsets, tag, value);
+}
+
+/* Parses a Tag_ABI_PCS_wchar_t value given on the command line. */
+int parse_wchar_size(const char* arg, struct options* opts)
+{
+  int wchar_size;
+  if (sscanf(arg, "%d", &wchar_size) != 1 || wchar_size < 0)
   {
-    printf("Error: Unknown ARM attribute section format version '%c'.\n", version);
+    printf("Invalid Tag_ABI_PCS_wchar_t value %s.\n", arg);
     return 1;
   }
   
-  off_t pos = 1;
-  
-  while (pos < sh_size)
+  return add_set(opts, 18, wchar_size);
+}
+
+/* Parses a TAG=VALUE argument of --set or --if. */
+int parse_tag_value(const char* arg, unsigned long* tag, unsigned long* value)
+{
+  const char* eq = strchr(arg, '=');
+  char* end;
+  if (eq != NULL)
   {
-    Elf32_Word subsect_size;
-    if (pos + sizeof(subsect_size) > sh_size)
+    char* name = strndup(arg, eq - arg);
+    int ret = parse_tag(name, tag);
+    free(name);
+    if (ret == 0)
     {
-      printf("Error: Unexpected end of ARM attribute section\n");
-      return 1;
-    }
-    if (read(fd, &subsect_size, sizeof(subsect_size)) != sizeof(subsect_size))
-    {
-      perror("reading subsection size");
-      return 1;
+      *value = strtoul(eq + 1, &end, 0);
+      if (eq[1] != '\0' && eq[1] != '-' && *end == '\0')
+        return 0;
     }
-    if (pos + subsect_size > sh_size)
+  }
+  
+  printf("Invalid attribute setting %s, expected TAG=VALUE.\n", arg);
+  return 1;
+}
+
+/* Adds the comma-separated tags of --query to 'opts'. */
+int parse_query(const char* arg, struct options* opts)
+{
+  char* list = strdup(arg);
+  char* save;
+  for (char* name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+  {
+    if (opts->nquery == 64)
     {
-      printf("Error: ARM attribute subsection outside of section bounds.\n");
+      printf("Error: Too many tags in --query.\n");
+      free(list);
       return 1;
     }
-    
-    off_t spos = sizeof(subsect_size); // positon within subsection
-    
-    char vendor_name[128];
-    ret = parse_ntbs(fd, vendor_name, sizeof(vendor_name), &spos, subsect_size);
-    if (ret != 0)
-      return ret;
-      
-    if (strcmp(vendor_name, "aeabi") == 0)
+    unsigned long* query = realloc(opts->query, (opts->nquery + 1) * sizeof(*query));
+    if (query == NULL)
     {
-      ret = parse_eabi_attr_aeabi_subsection(fd, &spos, subsect_size, wchar_size);
-      if (ret != 0)
-        return ret;
+      perror("allocating query");
+      exit(1);
     }
-    else
+    opts->query = query;
+    if (parse_tag(name, &opts->query[opts->nquery]) != 0)
     {
-      if (lseek(fd, subsect_size - spos, SEEK_CUR) != -1)
-      {
-        perror("skipping over unknown subsection");
-        return 1;
-      }
-      
-      spos = subsect_size;
+      printf("Unknown attribute tag %s.\n", name);
+      free(list);
+      return 1;
     }
-      
-    pos += spos;
+    ++opts->nquery;
   }
-  
+  free(list);
   return 0;
 }
 
-/* Parses the ELF file */
-int parse(int fd, char wchar_size)
+/* Saves the index, prints the --stats summary and frees the learned
+   signatures at the end of a run. */
+int finish(const char* index_file, int stats, int ret)
 {
-  Elf32_Ehdr ehdr;
-  if (read(fd, &ehdr, sizeof(ehdr)) != sizeof(ehdr))
-  {
-    perror("reading ELf32_Ehdr");
-    return 1;
-  }
-  
-  if (memcmp(ehdr.e_ident, ELFMAG, 4) != 0)
+  if (stats)
   {
-    printf("Error: Invalid ELF magic.\n");
-    return 1;
+    unsigned long checked = signatures.checked, matched = signatures.matched;
+    fflush(stdout);
+    fprintf(stderr, "Signatures: %lu of %lu sections matched a known layout (%.1f%%); %d layouts learned.\n",
+            matched, checked, checked ? 100.0 * matched / checked : 0.0, signatures.nlearned);
   }
+  signatures_free();
+  return index_close(index_file, ret);
+}
 
-  // Real-world ARM EABI files don't have this, for some reason
-#ifdef IDENT_HAS_EABI  
-  if (ehdr.e_ident[EI_OSABI] != 64)
+int main(int argc, char** argv)
+{
+  static const struct option long_options[] =
   {
-    printf("Error: Not ARM EABI file.\n");
-    return 1;
-  }
-#endif
+    { "wchar",      required_argument, NULL, 'w' },
+    { "set",        required_argument, NULL, 's' },
+    { "if",         required_argument, NULL, 'I' },
+    { "remove",     required_argument, NULL, 'X' },
+    { "files-from", required_argument, NULL, 'T' },
+    { "null",       no_argument,       NULL, '0' },
+    { "recursive",  no_argument,       NULL, 'r' },
+    { "jobs",       required_argument, NULL, 'j' },
+    { "rules",      required_argument, NULL, 'R' },
+    { "preserve-timestamps", no_argument, NULL, 'p' },
+    { "io-uring",   no_argument,       NULL, 'U' },
+    { "prefetch",   optional_argument, NULL, 'P' },
+    { "physical-order", no_argument,   NULL, 'O' },
+    { "dump",       no_argument,       NULL, 'D' },
+    { "query",      required_argument, NULL, 'Q' },
+    { "index",      required_argument, NULL, 'N' },
+    { "stats",      no_argument,       NULL, 'S' },
+    { "filter",     no_argument,       NULL, 'F' },
+    { "help",       no_argument,       NULL, 'h' },
+    { NULL,         0,                 NULL, 0 }
+  };
+  
+  struct options opts;
+  memset(&opts, 0, sizeof(opts));
+  const char* files_from = NULL;
+  int delim = '\n';
+  int recursive = 0;
+  const char* rules_file = NULL;
+  const char* index_file = NULL;
+  int stats = 0;
+  int filter = 0;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
   
-  if (ehdr.e_machine != EM_ARM)
+  while ((opt = getopt_long(argc, argv, "w:s:T:0rj:R:ph", long_options, NULL)) != -1)
   {
-    printf("Error: Not an ARM ELF file.\n");
-    return 1;
+    switch (opt)
+    {
+      case 'w':
+        if (parse_wchar_size(optarg, &opts) != 0)
+          return 1;
+        break;
+      case 'X':
+      {
+        unsigned long tag;
+        if (parse_tag(optarg, &tag) != 0 || tag < 4)
+        {
+          printf("Invalid attribute tag %s.\n", optarg);
+          return 1;
+        }
+        unsigned long* removes = realloc(opts.removes, (opts.nremoves + 1) * sizeof(*removes));
+        if (removes == NULL)
+        {
+          perror("allocating attribute list");
+          return 1;
+        }
+        opts.removes = removes;
+        opts.removes[opts.nremoves++] = tag;
+        break;
+      }
+      case 's':
+      case 'I':
+      {
+        unsigned long tag, value;
+        if (parse_tag_value(optarg, &tag, &value) != 0)
+          return 1;
+        if (opt == 's' ? add_set(&opts, tag, value) != 0 : add_tag_value(&opts.conds, &opts.nconds, tag, value) != 0)
+          return 1;
+        break;
+      }
+      case 'T':
+        files_from = optarg;
+        break;
+      case '0':
+        delim = '\0';
+        break;
+      case 'r':
+        recursive = 1;
+        break;
+      case 'j':
+        if (sscanf(optarg, "%d", &nthreads) != 1 || nthreads < 1)
+        {
+          printf("Invalid number of jobs %s.\n", optarg);
+          return 1;
+        }
+        break;
+      case 'R':
+        rules_file = optarg;
+        break;
+      case 'p':
+        opts.preserve_timestamps = 1;
+        break;
+      case 'U':
+        opts.io_uring = 1;
+        break;
+      case 'O':
+        opts.physical_order = 1;
+        break;
+      case 'D':
+        opts.dump = 1;
+        break;
+      case 'Q':
+        if (parse_query(optarg, &opts) != 0)
+          return 1;
+        break;
+      case 'N':
+        index_file = optarg;
+        break;
+      case 'S':
+        stats = 1;
+        break;
+      case 'F':
+        filter = 1;
+        break;
+      case 'P':
+      {
+        int kb = 64;
+        if (optarg != NULL && (sscanf(optarg, "%d", &kb) != 1 || kb < 1 || kb > 65536))
+        {
+          printf("Invalid prefetch size %s.\n", optarg);
+          return 1;
+        }
+        opts.prefetch = (size_t)kb * 1024;
+        break;
+      }
+      default:
+        usage();
+        return 1;
+    }
   }
   
-  if (ehdr.e_shoff == 0)
+  int nfiles = argc - optind;
+  char** files = argv + optind;
+  
+  if (opts.dump || opts.nquery > 0)
   {
-    printf("Error: ELF file has no section table.\n");
-    return 1;
+    if (patching(&opts))
+    {
+      printf("Error: --dump and --query only display attributes.\n");
+      return 1;
+    }
+    report_json = 1;
   }
   
-  if (ehdr.e_shentsize != sizeof(Elf32_Shdr))
+  if (filter)
   {
-    printf("Error: Section header entry size %d doesn't match sizeof(ELf32_Shdr)=%d.\n", ehdr.e_shentsize, sizeof(Elf32_Shdr));
-    return 1;
+    if (nfiles > 0 || files_from != NULL || recursive || index_file != NULL)
+    {
+      printf("Error: --filter only reads stdin, without --index.\n");
+      return 1;
+    }
+    return finish(NULL, stats, process_filter(&opts));
   }
   
-  if (lseek(fd, ehdr.e_shoff, SEEK_SET) == (off_t)-1)
-  {
-    perror("seeking to section header table");
+  if (index_file != NULL && index_open(index_file) != 0)
     return 1;
-  }
   
-  for (int i=0; i<ehdr.e_shnum; ++i)
+  if (recursive)
   {
-    Elf32_Shdr shdr;
-    if (read(fd, &shdr, sizeof(shdr)) != sizeof(shdr))
-    {
-      perror("reading Elf32_Shdr");
+    struct rules rules;
+    if (rules_file != NULL && rules_load(rules_file, &rules) != 0)
       return 1;
-    }
     
-    if (shdr.sh_type != SHT_ARM_ATTRIBUTES)
-      continue;
-      
-    off_t current_pos = lseek(fd, 0, SEEK_CUR);
-      
-    if (lseek(fd, shdr.sh_offset, SEEK_SET) == (off_t)-1)
+    char** roots = files;
+    if (nfiles == 0 && rules_file != NULL)
     {
-      perror("seeking to attributes section");
-      return 1;
+      roots = malloc(rules.nsections * sizeof(char*));
+      if (roots == NULL)
+      {
+        perror("allocating roots");
+        return 1;
+      }
+      for (int i=0; i<rules.nsections; ++i)
+      {
+        if (strcmp(rules.sections[i].root, "*") != 0)
+          roots[nfiles++] = rules.sections[i].root;
+      }
     }
     
-    int ret = parse_eabi_attr_section(fd, shdr.sh_size, wchar_size);
-    if (ret != 0)
-      return ret;
-    
-    if (lseek(fd, current_pos, SEEK_SET) == (off_t)-1)
+    if (nfiles == 0)
     {
-      perror("restoring position");
+      usage();
       return 1;
     }
+    if (nthreads < 1)
+      nthreads = 1;
+    return finish(index_file, stats, process_recursive(roots, nfiles, nthreads, rules_file ? &rules : NULL, &opts));
   }
   
-  return 0;
-}
-
-int process(const char* filename, int wchar_size)
-{
-  int fd = open(filename, O_RDWR);
-  if (fd == -1)
+  // legacy syntax: arm-wchar-tag [filename] [Tag_ABI_PCS_wchar_t]
+  if (!patching(&opts) && files_from == NULL && nfiles == 2)
   {
-    perror("opening file");
-    return 1;
+    int dummy;
+    if (sscanf(files[1], "%d", &dummy) == 1 && access(files[1], F_OK) != 0)
+    {
+      if (parse_wchar_size(files[1], &opts) != 0)
+        return 1;
+      nfiles = 1;
+    }
   }
   
-  int ret = parse(fd, wchar_size);
-  
-  close(fd);
-  
-  return ret;
-}
-
-int main(int argc, const char** argv)
-{
-  if (argc < 2 || argc > 3)
+  if (nfiles == 0 && files_from == NULL)
   {
-    printf("Syntax: arm-wchar-tag [filename] [Tag_ABI_PCS_wchar_t]\n");
+    usage();
     return 1;
   }
   
-  int wchar_size;
-  if (argc == 3)
+  // a single file keeps the original, unprefixed output
+  if (nfiles == 1 && files_from == NULL)
+    return finish(index_file, stats, process(files[0], report_json ? files[0] : NULL, &opts));
+  
+  char** names = NULL;
+  size_t nnames = 0;
+  if (nfiles > 0)
   {
-    if (sscanf(argv[2], "%d", &wchar_size) != 1)
+    names = malloc(nfiles * sizeof(char*));
+    if (names == NULL)
     {
-      printf("Invalid Tag_ABI_PCS_wchar_t value %s.\n", argv[2]);
+      perror("allocating file list");
       return 1;
     }
+    for (int i=0; i<nfiles; ++i)
+      names[nnames++] = strdup(files[i]);
+  }
   
-    if (wchar_size > 0x7f)
+  if (files_from != NULL)
+  {
+    FILE* list = stdin;
+    if (strcmp(files_from, "-") != 0)
     {
-      printf("Error: We do not support patching with TAG_ABI_PCS_wchar_t %d greater than 0x7f.\n", wchar_size);
-      return 1;
+      list = fopen(files_from, "r");
+      if (list == NULL)
+      {
+        report_error(files_from);
+        return 1;
+      }
     }
+    
+    int ret = read_list(list, delim, &names, &nnames);
+    
+    if (list != stdin)
+      fclose(list);
+    if (ret != 0)
+      return 1;
   }
-  else
-  {
-    wchar_size = -1;
-  }
-
-  return process(argv[1], (char)wchar_size);
+  
+  int ret = process_names(names, nnames, &opts);
+  
+  for (size_t i=0; i<nnames; ++i)
+    free(names[i]);
+  free(names);
+  
+  return finish(index_file, stats, ret);
 }
@@ -0,0 +1,1070 @@
+/*
+ * armattr.c
+ *
+ * Parsing and patching of ARM EABI build attributes;
+ * see armattr.h.
+ *
+ * For documentation, see:
+ * http://infocenter.arm.com/help/topic/com.arm.doc.ihi0045c/IHI0045C_ABI_addenda.pdf
+ * [ Addenda to, and Errata in, the ABI for the ARM® Architecture ]
+ *
+ * This code is in the public domain.
+ */
+#include "armattr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+// -DARMATTR_NO_SIMD builds the scalar loops only, to compare against
+#if defined(ARMATTR_NO_SIMD)
+#define SIMD 0
+#else
+#define SIMD 1
+#endif
+
+#if SIMD && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#elif SIMD && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Sets the error message. Returns nonzero, for the caller to return. */
+static int fail(struct armattr_error* error, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static int fail(struct armattr_error* error, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vsnprintf(error->msg, sizeof(error->msg), format, args);
+  va_end(args);
+  return 1;
+}
+
+/* Sets the error message for a failed library call. */
+static int fail_errno(struct armattr_error* error, const char* what)
+{
+  return fail(error, "%s: %s.", what, strerror(errno));
+}
+
+/* Loads and stores of fields of 2, 4 or 8 bytes in either byte order.
+   Both the size and the byte order are constants wherever these are
+   inlined into, so each compiles down to a plain or byte-swapped move. */
+static inline uint64_t load(const uint8_t* p, size_t size, int big_endian)
+{
+  if (size == 2)
+  {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return big_endian ? be16toh(v) : le16toh(v);
+  }
+  if (size == 4)
+  {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return big_endian ? be32toh(v) : le32toh(v);
+  }
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return big_endian ? be64toh(v) : le64toh(v);
+}
+
+static inline void store(uint8_t* p, size_t size, uint64_t value, int big_endian)
+{
+  if (size == 4)
+  {
+    uint32_t v = big_endian ? htobe32(value) : htole32(value);
+    memcpy(p, &v, sizeof(v));
+  }
+  else
+  {
+    uint64_t v = big_endian ? htobe64(value) : htole64(value);
+    memcpy(p, &v, sizeof(v));
+  }
+}
+
+#define FIELD(p, type, field, big_endian) \
+  load((p) + offsetof(type, field), sizeof(((type*)0)->field), big_endian)
+
+/* Returns the position of the first byte at or after 'pos' that ends
+   an ULEB128 (has its top bit clear) or, with 'nul' set, an NTBS, or
+   'size' if there is none. Strings and padded values are short, where
+   a call to memchr() costs more than the search, so this is inlined,
+   and looks at 32 (AVX2) or 16 (SSE2, NEON) bytes at a time as long as
+   a whole window fits before 'size'. */
+static inline size_t find_end(const uint8_t* data, size_t pos, size_t size, int nul)
+{
+#if SIMD && defined(__AVX2__)
+  for (; pos + 32 <= size; pos += 32)
+  {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + pos));
+    if (nul)
+      bytes = _mm256_cmpeq_epi8(bytes, _mm256_setzero_si256());
+    uint32_t ends = (uint32_t)_mm256_movemask_epi8(bytes);
+    if (!nul)
+      ends = ~ends;
+    if (ends != 0)
+      return pos + __builtin_ctz(ends);
+  }
+#endif
+#if SIMD && defined(__SSE2__)
+  for (; pos + 16 <= size; pos += 16)
+  {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(data + pos));
+    if (nul)
+      bytes = _mm_cmpeq_epi8(bytes, _mm_setzero_si128());
+    uint32_t ends = (uint32_t)_mm_movemask_epi8(bytes);
+    if (!nul)
+      ends = ~ends & 0xffff;
+    if (ends != 0)
+      return pos + __builtin_ctz(ends);
+  }
+#elif SIMD && defined(__ARM_NEON)
+  for (; pos + 16 <= size; pos += 16)
+  {
+    // NEON has no movemask: narrow the compare result to 4 bits per byte
+    uint8x16_t bytes = vld1q_u8(data + pos);
+    uint8x16_t ends = nul ? vceqq_u8(bytes, vdupq_n_u8(0)) : vcltq_u8(bytes, vdupq_n_u8(0x80));
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(ends), 4);
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+    if (mask != 0)
+      return pos + (__builtin_ctzll(mask) >> 2);
+  }
+#endif
+  if (nul)
+  {
+    while (pos < size && data[pos] != 0)
+      ++pos;
+  }
+  else
+  {
+    while (pos < size && (data[pos] & 0x80) != 0)
+      ++pos;
+  }
+  return pos;
+}
+
+/* Reads an ULEB128 (variable-length integer) value from the section data.
+
+   'pos' is the current position within the section and 'size' is the
+   size of the section. The function will take care not to run outside
+   of the section. Values of one or two bytes, which is nearly all of
+   them, are decoded directly; longer ones (such as those padded by
+   armattr_plan_section()) are delimited with find_end() first. */
+int armattr_uleb128(const uint8_t* data, unsigned long* result, size_t* pos, size_t size)
+{
+  size_t start = *pos;
+  *result = 0;
+  if (start >= size)
+    return 0;
+  
+  unsigned long byte0 = data[start];
+  if (byte0 < 0x80)
+  {
+    *result = byte0;
+    *pos = start + 1;
+    return 0;
+  }
+  if (start + 1 < size && data[start + 1] < 0x80)
+  {
+    *result = (byte0 & 0x7f) | ((unsigned long)data[start + 1] << 7);
+    *pos = start + 2;
+    return 0;
+  }
+  
+  size_t end = find_end(data, start + 1, size, 0);
+  if (end == size)
+  {
+    *pos = size;
+    return 1;
+  }
+  
+  // bits that don't fit into an unsigned long are dropped
+  unsigned long value = 0;
+  unsigned shift = 0;
+  for (size_t i=start; i<=end && shift < sizeof(value) * 8; ++i, shift += 7)
+    value |= (unsigned long)(data[i] & 0x7f) << shift;
+  *result = value;
+  *pos = end + 1;
+  return 0;
+}
+
+/* Skips over an NTBS (null-terminated string) value in the section
+   data, returning a view of it in 'result'; nothing is copied. */
+static int parse_ntbs(const uint8_t* data, struct armattr_str* result, size_t* pos, size_t size)
+{
+  size_t end = find_end(data, *pos, size, 1);
+  if (end == size)
+    return 1;
+  
+  if (result != NULL)
+  {
+    result->ptr = (const char*)data + *pos;
+    result->len = end - *pos;
+  }
+  *pos = end + 1;
+  return 0;
+}
+
+size_t armattr_uleb128_size(unsigned long value)
+{
+  size_t size = 1;
+  while (value >>= 7)
+    ++size;
+  return size;
+}
+
+void armattr_uleb128_encode(unsigned long value, uint8_t* out, size_t len)
+{
+  for (size_t i=0; i<len; ++i)
+  {
+    out[i] = (value & 0x7f) | (i + 1 < len ? 0x80 : 0);
+    value >>= 7;
+  }
+}
+
+#define VALUES(v) v, (int)(sizeof(v) / sizeof(v[0]))
+
+static const char* const no_yes[] = { "No", "Yes" };
+static const char* const not_allowed_allowed[] = { "Not Allowed", "Allowed" };
+static const char* const unused_needed[] = { "Unused", "Needed" };
+static const char* const cpu_arch[] =
+{
+  "Pre-v4", "v4", "v4T", "v5T", "v5TE", "v5TEJ", "v6", "v6KZ", "v6T2", "v6K", "v7",
+  "v6-M", "v6S-M", "v7E-M", "v8-A", "v8-R", "v8-M.baseline", "v8-M.mainline",
+  "v8.1-A", "v8.2-A", "v8.3-A", "v8.1-M.mainline", "v9-A"
+};
+static const char* const cpu_arch_profile[] =
+{
+  [0] = "None", ['A'] = "Application", ['R'] = "Realtime",
+  ['M'] = "Microcontroller", ['S'] = "Application or Realtime"
+};
+static const char* const thumb_isa_use[] = { "No", "Thumb-1", "Thumb-2", "Yes" };
+static const char* const fp_arch[] =
+{
+  "No", "VFPv1", "VFPv2", "VFPv3", "VFPv3-D16", "VFPv4", "VFPv4-D16", "FP for ARMv8", "FPv5/FP-D16 for ARMv8"
+};
+static const char* const wmmx_arch[] = { "No", "WMMXv1", "WMMXv2" };
+static const char* const simd_arch[] = { "No", "NEONv1", "NEONv1 with Fused-MAC", "NEON for ARMv8", "NEON for ARMv8.1" };
+static const char* const pcs_config[] =
+{
+  "None", "Bare platform", "Linux application", "Linux DSO",
+  "PalmOS 2004", "PalmOS (reserved)", "SymbianOS 2004", "SymbianOS (reserved)"
+};
+static const char* const r9_use[] = { "V6", "SB", "TLS", "Unused" };
+static const char* const rw_data[] = { "Absolute", "PC-relative", "SB-relative", "None" };
+static const char* const ro_data[] = { "Absolute", "PC-relative", "None" };
+static const char* const got_use[] = { "None", "direct", "GOT-indirect" };
+static const char* const wchar_t_size[] = { [0] = "None", [2] = "2 bytes", [4] = "4 bytes" };
+static const char* const fp_denormal[] = { "Unused", "Needed", "Sign only" };
+static const char* const fp_number_model[] = { "Unused", "Finite", "RTABI", "IEEE 754" };
+static const char* const align_needed[] = { "None", "8-byte", "4-byte", "Reserved" };
+static const char* const align_preserved[] = { "None", "8-byte, except leaf SP", "8-byte", "Reserved" };
+static const char* const enum_size[] = { "Unused", "small", "int", "forced to int" };
+static const char* const hardfp_use[] = { "As Tag_FP_arch", "SP only", "Reserved", "Deprecated" };
+static const char* const vfp_args[] = { "AAPCS", "VFP registers", "custom", "compatible" };
+static const char* const wmmx_args[] = { "AAPCS", "WMMX registers", "custom" };
+static const char* const optimization_goals[] =
+{
+  "None", "Prefer Speed", "Aggressive Speed", "Prefer Size", "Aggressive Size", "Prefer Debug", "Aggressive Debug"
+};
+static const char* const fp_optimization_goals[] =
+{
+  "None", "Prefer Speed", "Aggressive Speed", "Prefer Size", "Aggressive Size", "Prefer Accuracy", "Aggressive Accuracy"
+};
+static const char* const unaligned_access[] = { "None", "v6" };
+static const char* const fp_16bit_format[] = { "None", "IEEE 754", "Alternative Format" };
+static const char* const div_use[] =
+{
+  "Allowed in Thumb-ISA, v7-R or v7-M", "Not allowed", "Allowed in v7-A with integer division extension"
+};
+static const char* const dsp_extension[] = { "Follow architecture", "Allowed" };
+static const char* const mve_arch[] = { "Not allowed", "MVE integer", "MVE integer and float" };
+static const char* const pac_bti_extension[] = { "Not allowed", "Allowed in NOP space", "Allowed" };
+static const char* const not_used_used[] = { "Not used", "Used" };
+static const char* const virtualization_use[] =
+{
+  "Not Allowed", "TrustZone", "Virtualization Extensions", "TrustZone and Virtualization Extensions"
+};
+
+/* The attributes defined by the addenda, indexed by tag. Tags that
+   aren't in here are encoded by the convention for tags above 32. */
+#define TAG(tag, name, encoding, values) [tag] = { tag, name, ARMATTR_##encoding, values }
+#define NONE NULL, 0
+
+static const struct armattr_tag tags[] =
+{
+  TAG(4,  "Tag_CPU_raw_name", NTBS, NONE),
+  TAG(5,  "Tag_CPU_name", NTBS, NONE),
+  TAG(6,  "Tag_CPU_arch", ULEB, VALUES(cpu_arch)),
+  TAG(7,  "Tag_CPU_arch_profile", ULEB, VALUES(cpu_arch_profile)),
+  TAG(8,  "Tag_ARM_ISA_use", ULEB, VALUES(no_yes)),
+  TAG(9,  "Tag_THUMB_ISA_use", ULEB, VALUES(thumb_isa_use)),
+  TAG(10, "Tag_FP_arch", ULEB, VALUES(fp_arch)),
+  TAG(11, "Tag_WMMX_arch", ULEB, VALUES(wmmx_arch)),
+  TAG(12, "Tag_Advanced_SIMD_arch", ULEB, VALUES(simd_arch)),
+  TAG(13, "Tag_PCS_config", ULEB, VALUES(pcs_config)),
+  TAG(14, "Tag_ABI_PCS_R9_use", ULEB, VALUES(r9_use)),
+  TAG(15, "Tag_ABI_PCS_RW_data", ULEB, VALUES(rw_data)),
+  TAG(16, "Tag_ABI_PCS_RO_data", ULEB, VALUES(ro_data)),
+  TAG(17, "Tag_ABI_PCS_GOT_use", ULEB, VALUES(got_use)),
+  TAG(18, "Tag_ABI_PCS_wchar_t", ULEB, VALUES(wchar_t_size)),
+  TAG(19, "Tag_ABI_FP_rounding", ULEB, VALUES(unused_needed)),
+  TAG(20, "Tag_ABI_FP_denormal", ULEB, VALUES(fp_denormal)),
+  TAG(21, "Tag_ABI_FP_exceptions", ULEB, VALUES(unused_needed)),
+  TAG(22, "Tag_ABI_FP_user_exceptions", ULEB, VALUES(unused_needed)),
+  TAG(23, "Tag_ABI_FP_number_model", ULEB, VALUES(fp_number_model)),
+  TAG(24, "Tag_ABI_align_needed", ULEB, VALUES(align_needed)),
+  TAG(25, "Tag_ABI_align_preserved", ULEB, VALUES(align_preserved)),
+  TAG(26, "Tag_ABI_enum_size", ULEB, VALUES(enum_size)),
+  TAG(27, "Tag_ABI_HardFP_use", ULEB, VALUES(hardfp_use)),
+  TAG(28, "Tag_ABI_VFP_args", ULEB, VALUES(vfp_args)),
+  TAG(29, "Tag_ABI_WMMX_args", ULEB, VALUES(wmmx_args)),
+  TAG(30, "Tag_ABI_optimization_goals", ULEB, VALUES(optimization_goals)),
+  TAG(31, "Tag_ABI_FP_optimization_goals", ULEB, VALUES(fp_optimization_goals)),
+  TAG(32, "Tag_compatibility", COMPAT, NONE),
+  TAG(34, "Tag_CPU_unaligned_access", ULEB, VALUES(unaligned_access)),
+  TAG(36, "Tag_FP_HP_extension", ULEB, VALUES(not_allowed_allowed)),
+  TAG(38, "Tag_ABI_FP_16bit_format", ULEB, VALUES(fp_16bit_format)),
+  TAG(42, "Tag_MPextension_use", ULEB, VALUES(not_allowed_allowed)),
+  TAG(44, "Tag_DIV_use", ULEB, VALUES(div_use)),
+  TAG(46, "Tag_DSP_extension", ULEB, VALUES(dsp_extension)),
+  TAG(48, "Tag_MVE_arch", ULEB, VALUES(mve_arch)),
+  TAG(50, "Tag_PAC_extension", ULEB, VALUES(pac_bti_extension)),
+  TAG(52, "Tag_BTI_extension", ULEB, VALUES(pac_bti_extension)),
+  TAG(64, "Tag_nodefaults", ULEB, NONE),
+  TAG(65, "Tag_also_compatible_with", NTBS, NONE),
+  TAG(66, "Tag_T2EE_use", ULEB, VALUES(not_allowed_allowed)),
+  TAG(67, "Tag_conformance", NTBS, NONE),
+  TAG(68, "Tag_Virtualization_use", ULEB, VALUES(virtualization_use)),
+  TAG(70, "Tag_MPextension_use_legacy", ULEB, VALUES(not_allowed_allowed)),
+  TAG(74, "Tag_BTI_use", ULEB, VALUES(not_used_used)),
+  TAG(76, "Tag_PACRET_use", ULEB, VALUES(not_used_used)),
+};
+
+#define NTAGS (sizeof(tags) / sizeof(tags[0]))
+
+const struct armattr_tag* armattr_find_tag(unsigned long tag)
+{
+  if (tag < NTAGS && tags[tag].name != NULL)
+    return &tags[tag];
+  return NULL;
+}
+
+const struct armattr_tag* armattr_find_tag_name(const char* name)
+{
+  for (size_t i=0; i<NTAGS; ++i)
+  {
+    if (tags[i].name != NULL && strcmp(tags[i].name, name) == 0)
+      return &tags[i];
+  }
+  return NULL;
+}
+
+/* AArch64 attributes, by subsection. */
+static const struct armattr_tag feature_and_bits_tags[] =
+{
+  TAG(0,  "Tag_Feature_BTI", ULEB, VALUES(not_used_used)),
+  TAG(1,  "Tag_Feature_PAC", ULEB, VALUES(not_used_used)),
+  TAG(2,  "Tag_Feature_GCS", ULEB, VALUES(not_used_used)),
+};
+
+static const struct armattr_tag pauthabi_tags[] =
+{
+  TAG(1,  "Tag_PAuth_Platform", ULEB, NONE),
+  TAG(2,  "Tag_PAuth_Schema", ULEB, NONE),
+};
+
+static const struct
+{
+  const char* vendor;
+  const struct armattr_tag* tags;
+  size_t ntags;
+} vendor_tags[] =
+{
+  { "aeabi", tags, NTAGS },
+  { "aeabi_feature_and_bits", VALUES(feature_and_bits_tags) },
+  { "aeabi_pauthabi", VALUES(pauthabi_tags) },
+};
+
+const struct armattr_tag* armattr_find_vendor_tag(const char* vendor, unsigned long tag)
+{
+  for (size_t i=0; i<sizeof(vendor_tags) / sizeof(vendor_tags[0]); ++i)
+  {
+    if (strcmp(vendor_tags[i].vendor, vendor) == 0)
+    {
+      if (tag >= vendor_tags[i].ntags)
+        return NULL;
+      const struct armattr_tag* found = &vendor_tags[i].tags[tag];
+      return (found->name != NULL) ? found : NULL;
+    }
+  }
+  return NULL;
+}
+
+int armattr_encoding(unsigned long tag)
+{
+  if (tag < NTAGS && tags[tag].name != NULL)
+    return tags[tag].encoding;
+  return (tag > 32 && (tag % 2) == 1) ? ARMATTR_NTBS : ARMATTR_ULEB;
+}
+
+int armattr_iter_init(struct armattr_iter* it, const uint8_t* data, size_t size)
+{
+  return armattr_iter_init_elf(it, NULL, data, size);
+}
+
+int armattr_iter_init_elf(struct armattr_iter* it, const struct armattr_elf* elf, const uint8_t* data, size_t size)
+{
+  memset(it, 0, sizeof(*it));
+  it->data = data;
+  it->size = size;
+  it->pos = 1;
+  if (elf != NULL)
+  {
+    it->big_endian = elf->big_endian;
+    it->aarch64 = (elf->machine == EM_AARCH64);
+  }
+  
+  if (size < 1)
+    return fail(&it->error, "Empty ARM attributes section.");
+  if (data[0] != 'A')
+    return fail(&it->error, "Unknown ARM attribute section format version '%c'.", data[0]);
+  return 0;
+}
+
+/* Starts the subsection at it->pos: decodes the next ones from its
+   sub-subsections if it is "aeabi", returns it as a whole otherwise.
+   AArch64 subsections have no sub-subsections: a byte that says
+   whether they are optional and one that gives the encoding of all
+   their values come before the attributes, which apply to the whole
+   file, so any vendor's are decoded. */
+static int next_subsection(struct armattr_iter* it, struct armattr_attr* attr)
+{
+  Elf32_Word subsect_size;
+  if (it->pos + sizeof(subsect_size) > it->size)
+  {
+    fail(&it->error, "Unexpected end of ARM attribute section");
+    return ARMATTR_ERROR;
+  }
+  subsect_size = load(it->data + it->pos, sizeof(subsect_size), it->big_endian);
+  if (subsect_size < sizeof(subsect_size) || it->pos + subsect_size > it->size)
+  {
+    fail(&it->error, "ARM attribute subsection outside of section bounds.");
+    return ARMATTR_ERROR;
+  }
+  
+  const uint8_t* subsect = it->data + it->pos;
+  size_t spos = sizeof(subsect_size);
+  if (parse_ntbs(subsect, &attr->vendor, &spos, subsect_size) != 0)
+  {
+    fail(&it->error, "Unterminated NTBS.");
+    return ARMATTR_ERROR;
+  }
+  it->vendor = attr->vendor;
+  
+  if (it->aarch64)
+  {
+    if (spos + 2 > subsect_size)
+    {
+      fail(&it->error, "Unexpected end of AArch64 attribute subsection.");
+      return ARMATTR_ERROR;
+    }
+    if (subsect[spos + 1] > 1)
+    {
+      fail(&it->error, "Unknown AArch64 attribute encoding %d.", subsect[spos + 1]);
+      return ARMATTR_ERROR;
+    }
+    it->encoding = subsect[spos + 1] ? ARMATTR_NTBS : ARMATTR_ULEB;
+    spos += 2;
+    it->subsect = subsect;
+    it->subsect_size = subsect_size;
+    it->spos = it->ids = it->ids_end = spos;
+    it->subsub_end = subsect_size;
+    it->scope = ARMATTR_FILE;
+    return ARMATTR_END;
+  }
+  
+  if (strcmp(attr->vendor.ptr, "aeabi") == 0)
+  {
+    it->subsect = subsect;
+    it->subsect_size = subsect_size;
+    it->spos = it->subsub_end = spos;
+    return ARMATTR_END;
+  }
+  
+  // unknown vendor subsections are returned without decoding
+  attr->offset = it->pos;
+  attr->len = subsect_size;
+  it->pos += subsect_size;
+  return ARMATTR_VENDOR;
+}
+
+/* Reads the <tag, uint32 size> header of the sub-subsection at
+   it->spos and the section or symbol numbers after it. */
+static int next_subsubsection(struct armattr_iter* it)
+{
+  const uint8_t* data = it->subsect;
+  size_t start = it->spos;
+  if (armattr_uleb128(data, &it->scope, &it->spos, it->subsect_size) != 0)
+    return fail(&it->error, "Unterminated ULEB128.");
+  
+  Elf32_Word size;
+  if (it->spos + sizeof(size) > it->subsect_size)
+    return fail(&it->error, "Unexpected end of aeabi subsection.");
+  size = load(data + it->spos, sizeof(size), it->big_endian);
+  it->spos += sizeof(size);
+  
+  if (size < it->spos - start || start + size > it->subsect_size)
+    return fail(&it->error, "aeabi sub-subsection outside of subsection bounds.");
+  it->subsub_end = start + size;
+  
+  // if tag = section or tag = symbol, skip over section/symbol identifiers
+  it->ids = it->spos;
+  if (it->scope == ARMATTR_SECTION || it->scope == ARMATTR_SYMBOL)
+  {
+    unsigned long id;
+    do
+    {
+      if (armattr_uleb128(data, &id, &it->spos, it->subsub_end) != 0)
+        return fail(&it->error, "Unterminated ULEB128.");
+    } while (id != 0);
+  }
+  it->ids_end = it->spos;
+  return 0;
+}
+
+/* Decodes the attribute at it->spos. */
+static int next_attribute(struct armattr_iter* it, struct armattr_attr* attr)
+{
+  const uint8_t* data = it->subsect;
+  size_t* pos = &it->spos;
+  size_t end = it->subsub_end;
+  int ret;
+  
+  if (armattr_uleb128(data, &attr->tag, pos, end) != 0)
+    return fail(&it->error, "Unterminated ULEB128.");
+  
+  size_t value_pos = *pos;
+  int encoding = it->aarch64 ? it->encoding : armattr_encoding(attr->tag);
+  if (encoding != ARMATTR_NTBS && armattr_uleb128(data, &attr->value, pos, end) != 0)
+    return fail(&it->error, "Unterminated ULEB128.");
+  ret = (encoding != ARMATTR_ULEB) ? parse_ntbs(data, &attr->str, pos, end) : 0;
+  if (ret != 0)
+    return fail(&it->error, "Unterminated NTBS.");
+  
+  attr->vendor = it->vendor;
+  attr->offset = it->pos + value_pos;
+  attr->len = *pos - value_pos;
+  attr->scope = it->scope;
+  attr->ids = data + it->ids;
+  attr->ids_end = data + it->ids_end;
+  return 0;
+}
+
+int armattr_next(struct armattr_iter* it, struct armattr_attr* attr)
+{
+  memset(attr, 0, sizeof(*attr));
+  
+  for (;;)
+  {
+    if (it->subsect == NULL)
+    {
+      if (it->pos >= it->size)
+        return ARMATTR_END;
+      int ret = next_subsection(it, attr);
+      if (ret != ARMATTR_END)
+        return ret;
+    }
+    else if (it->spos < it->subsub_end)
+      return next_attribute(it, attr) == 0 ? ARMATTR_ATTR : ARMATTR_ERROR;
+    else if (it->spos < it->subsect_size)
+    {
+      if (next_subsubsection(it) != 0)
+        return ARMATTR_ERROR;
+    }
+    else
+    {
+      it->pos += it->subsect_size;
+      it->subsect = NULL;
+    }
+  }
+}
+
+/* Reads the header and walks the section table of one class and byte
+   order of ELF file. */
+#define DEFINE_ELF(name, Ehdr, Shdr, big_endian) \
+static int next_section_##name(const struct armattr_elf* elf, const uint8_t* shtab, int* index, \
+                               struct armattr_section* section) \
+{ \
+  for (int i = (*index < 0 ? (int)elf->shnum : *index) - 1; i >= 0; --i) \
+  { \
+    const uint8_t* shdr = shtab + (size_t)i * sizeof(Shdr); \
+    if (FIELD(shdr, Shdr, sh_type, big_endian) != SHT_ARM_ATTRIBUTES) \
+      continue; \
+    section->data = NULL; \
+    section->offset = FIELD(shdr, Shdr, sh_offset, big_endian); \
+    section->size = FIELD(shdr, Shdr, sh_size, big_endian); \
+    section->shdr = elf->shoff + (off_t)i * sizeof(Shdr); \
+    section->size_field = section->shdr + offsetof(Shdr, sh_size); \
+    *index = i; \
+    return 1; \
+  } \
+  *index = 0; \
+  return 0; \
+} \
+\
+static void read_ehdr_##name(const uint8_t* ehdr, struct armattr_elf* elf) \
+{ \
+  elf->machine = FIELD(ehdr, Ehdr, e_machine, big_endian); \
+  elf->shoff = FIELD(ehdr, Ehdr, e_shoff, big_endian); \
+  elf->shnum = FIELD(ehdr, Ehdr, e_shnum, big_endian); \
+  elf->shentsize = FIELD(ehdr, Ehdr, e_shentsize, big_endian); \
+  elf->next_section = next_section_##name; \
+}
+
+DEFINE_ELF(elf32_le, Elf32_Ehdr, Elf32_Shdr, 0)
+DEFINE_ELF(elf32_be, Elf32_Ehdr, Elf32_Shdr, 1)
+DEFINE_ELF(elf64_le, Elf64_Ehdr, Elf64_Shdr, 0)
+DEFINE_ELF(elf64_be, Elf64_Ehdr, Elf64_Shdr, 1)
+
+int armattr_read_ehdr(const uint8_t* data, size_t size, struct armattr_elf* elf, struct armattr_error* error)
+{
+  if (size < EI_NIDENT || memcmp(data, ELFMAG, SELFMAG) != 0)
+    return fail(error, "Invalid ELF magic.");
+  
+  // Real-world ARM EABI files don't have this, for some reason
+#ifdef IDENT_HAS_EABI
+  if (data[EI_OSABI] != 64)
+    return fail(error, "Not ARM EABI file.");
+#endif
+  
+  memset(elf, 0, sizeof(*elf));
+  if (data[EI_CLASS] != ELFCLASS32 && data[EI_CLASS] != ELFCLASS64)
+    return fail(error, "Unknown ELF class %d.", data[EI_CLASS]);
+  if (data[EI_DATA] != ELFDATA2LSB && data[EI_DATA] != ELFDATA2MSB)
+    return fail(error, "Unknown ELF byte order %d.", data[EI_DATA]);
+  elf->elf64 = (data[EI_CLASS] == ELFCLASS64);
+  elf->big_endian = (data[EI_DATA] == ELFDATA2MSB);
+  if (size < (elf->elf64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr)))
+    return fail(error, "File too small for an ELF header.");
+  
+  // the only place that looks at the class and byte order
+  if (elf->elf64)
+    (elf->big_endian ? read_ehdr_elf64_be : read_ehdr_elf64_le)(data, elf);
+  else
+    (elf->big_endian ? read_ehdr_elf32_be : read_ehdr_elf32_le)(data, elf);
+  
+  if (elf->machine != EM_ARM && elf->machine != EM_AARCH64)
+    return fail(error, "Not an ARM ELF file.");
+  
+  if (elf->shoff == 0)
+    return fail(error, "ELF file has no section table.");
+  
+  size_t shentsize = elf->elf64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+  if (elf->shentsize != shentsize)
+    return fail(error, "Section header entry size %d doesn't match sizeof(%s)=%d.",
+                (int)elf->shentsize, elf->elf64 ? "Elf64_Shdr" : "Elf32_Shdr", (int)shentsize);
+  
+  return 0;
+}
+
+int armattr_next_section(const struct armattr_elf* elf, const uint8_t* shtab, int* index,
+                         struct armattr_section* section)
+{
+  return elf->next_section(elf, shtab, index, section);
+}
+
+const struct armattr_tag_value* armattr_find_set(const struct armattr_edits* edits, unsigned long tag)
+{
+  for (int i=0; i<edits->nsets; ++i)
+  {
+    if (edits->sets[i].tag == tag)
+      return &edits->sets[i];
+  }
+  return NULL;
+}
+
+int armattr_is_removed(const struct armattr_edits* edits, unsigned long tag)
+{
+  for (int i=0; i<edits->nremoves; ++i)
+  {
+    if (edits->removes[i] == tag)
+      return 1;
+  }
+  return 0;
+}
+
+void armattr_plan_init(struct armattr_plan* plan)
+{
+  memset(plan, 0, sizeof(*plan));
+}
+
+void armattr_plan_free(struct armattr_plan* plan)
+{
+  free(plan->patches);
+  free(plan->data);
+  armattr_plan_init(plan);
+}
+
+void armattr_plan_clear(struct armattr_plan* plan)
+{
+  plan->npatches = 0;
+  plan->data_len = 0;
+}
+
+int armattr_plan_add(struct armattr_plan* plan, off_t offset, const void* data, size_t len, struct armattr_error* error)
+{
+  if (plan->data_len + len > plan->data_cap)
+  {
+    size_t cap = plan->data_cap ? plan->data_cap : 16;
+    while (cap < plan->data_len + len)
+      cap *= 2;
+    uint8_t* grown = realloc(plan->data, cap);
+    if (grown == NULL)
+      return fail_errno(error, "allocating patches");
+    plan->data = grown;
+    plan->data_cap = cap;
+  }
+  
+  if (plan->npatches == plan->patches_cap)
+  {
+    int cap = plan->patches_cap ? plan->patches_cap * 2 : 4;
+    struct armattr_patch* patches = realloc(plan->patches, cap * sizeof(*patches));
+    if (patches == NULL)
+      return fail_errno(error, "allocating patches");
+    plan->patches = patches;
+    plan->patches_cap = cap;
+  }
+  plan->patches[plan->npatches].offset = offset;
+  plan->patches[plan->npatches].len = len;
+  plan->patches[plan->npatches].data = plan->data_len;
+  memcpy(plan->data + plan->data_len, data, len);
+  plan->data_len += len;
+  ++plan->npatches;
+  return 0;
+}
+
+/* Longest ULEB128 freed bytes are padded into: 63 bits, which every
+   reader decodes without overflowing. */
+#define ULEB_MAX_PAD 9
+
+/* An ULEB128 value in a rebuilt section that can absorb padding, and
+   the length fields of the sub-subsection and subsection around it. */
+struct pad_field
+{
+  size_t pos;
+  size_t len;
+  unsigned long value;
+  size_t subsub_size_pos;
+  size_t subsect_size_pos;
+};
+
+/* Adds 'extra' to the uint32 length field at 'pos'. */
+static void grow_length(uint8_t* out, size_t pos, size_t extra, int big_endian)
+{
+  store(out + pos, 4, load(out + pos, 4, big_endian) + extra, big_endian);
+}
+
+/* Rebuilds the attributes section in 'data' without the removed tags
+   and with the new values, re-encoding the entries and updating the
+   sub-subsection and subsection lengths. The rest of the file stays
+   where it is: the section keeps its size by padding the freed bytes
+   into redundant continuation bytes of ULEB128 values, which linkers
+   decode like any other, and only if there are too few of those does
+   it shrink by patching its sh_size. The result is planned as one
+   patch of the bytes that changed. */
+static int rewrite_section(struct armattr_plan* plan, const struct armattr_edits* edits,
+                           const struct armattr_elf* elf, const uint8_t* data, size_t size,
+                           off_t offset, off_t size_field, struct armattr_error* error)
+{
+  int big_endian = (elf != NULL && elf->big_endian);
+  // every attribute takes at least two bytes and grows by at most ten
+  size_t cap = size * 6 + 16;
+  uint8_t* out = malloc(cap);
+  struct pad_field* pads = NULL;
+  size_t npads = 0, pads_cap = 0;
+  if (out == NULL)
+    return fail_errno(error, "allocating attributes section");
+  
+  // the section was parsed successfully, so its structure is sound
+  size_t n = 0;
+  out[n++] = data[0];
+  size_t pos = 1;
+  while (pos < size)
+  {
+    Elf32_Word subsect_size = load(data + pos, 4, big_endian);
+    const uint8_t* subsect = data + pos;
+    size_t spos = sizeof(subsect_size);
+    const char* vendor = (const char*)subsect + spos;
+    parse_ntbs(subsect, NULL, &spos, subsect_size);
+    
+    if (strcmp(vendor, "aeabi") != 0)
+    {
+      memcpy(out + n, subsect, subsect_size);
+      n += subsect_size;
+      pos += subsect_size;
+      continue;
+    }
+    
+    size_t subsect_start = n;
+    memcpy(out + n, subsect, spos);
+    n += spos;
+    
+    while (spos < subsect_size)
+    {
+      size_t start = spos;
+      unsigned long tag, attr, value;
+      armattr_uleb128(subsect, &tag, &spos, subsect_size);
+      size_t tag_len = spos - start;
+      Elf32_Word subsub_size = load(subsect + spos, 4, big_endian);
+      spos += sizeof(subsub_size);
+      size_t end = start + subsub_size;
+      if (tag == ARMATTR_SECTION || tag == ARMATTR_SYMBOL)
+      {
+        do
+          armattr_uleb128(subsect, &value, &spos, end);
+        while (value != 0);
+      }
+      
+      // the scope tag, the size and the section/symbol numbers stay
+      size_t subsub_start = n;
+      memcpy(out + n, subsect + start, spos - start);
+      n += spos - start;
+      
+      while (spos < end)
+      {
+        size_t attr_start = spos;
+        armattr_uleb128(subsect, &attr, &spos, end);
+        size_t value_start = spos;
+        int encoding = armattr_encoding(attr);
+        if (encoding != ARMATTR_NTBS)
+          armattr_uleb128(subsect, &value, &spos, end);
+        if (encoding != ARMATTR_ULEB)
+          parse_ntbs(subsect, NULL, &spos, end);
+        
+        if (armattr_is_removed(edits, attr))
+          continue;
+        
+        memcpy(out + n, subsect + attr_start, value_start - attr_start);
+        n += value_start - attr_start;
+        if (encoding != ARMATTR_ULEB)
+        {
+          memcpy(out + n, subsect + value_start, spos - value_start);
+          n += spos - value_start;
+          continue;
+        }
+        
+        const struct armattr_tag_value* set = armattr_find_set(edits, attr);
+        if (set != NULL)
+          value = set->value;
+        size_t len = armattr_uleb128_size(value);
+        armattr_uleb128_encode(value, out + n, len);
+        
+        if (npads == pads_cap)
+        {
+          pads_cap = pads_cap ? pads_cap * 2 : 16;
+          struct pad_field* grown = realloc(pads, pads_cap * sizeof(*pads));
+          if (grown == NULL)
+          {
+            fail_errno(error, "allocating attributes section");
+            free(pads);
+            free(out);
+            return 1;
+          }
+          pads = grown;
+        }
+        struct pad_field* pad = &pads[npads++];
+        pad->pos = n;
+        pad->len = len;
+        pad->value = value;
+        pad->subsub_size_pos = subsub_start + tag_len;
+        pad->subsect_size_pos = subsect_start;
+        n += len;
+      }
+      
+      store(out + subsub_start + tag_len, 4, n - subsub_start, big_endian);
+    }
+    
+    store(out + subsect_start, 4, n - subsect_start, big_endian);
+    pos += subsect_size;
+  }
+  
+  int ret = 0;
+  if (n > size)
+    ret = fail(error, "No room in the ARM attributes section for the new values.");
+  
+  // pad from the end, so that the fields not yet padded stay in place
+  size_t slack = (ret == 0) ? size - n : 0;
+  for (size_t i=npads; i-- > 0 && slack > 0; )
+  {
+    struct pad_field* pad = &pads[i];
+    if (pad->len >= ULEB_MAX_PAD)
+      continue;
+    size_t extra = ULEB_MAX_PAD - pad->len;
+    if (extra > slack)
+      extra = slack;
+    memmove(out + pad->pos + pad->len + extra, out + pad->pos + pad->len, n - pad->pos - pad->len);
+    armattr_uleb128_encode(pad->value, out + pad->pos, pad->len + extra);
+    grow_length(out, pad->subsub_size_pos, extra, big_endian);
+    grow_length(out, pad->subsect_size_pos, extra, big_endian);
+    n += extra;
+    slack -= extra;
+  }
+  
+  if (ret == 0 && slack > 0)
+  {
+    // not enough to pad into: shrink the section instead
+    if (size_field == 0)
+      ret = fail(error, "Unable to shrink the ARM attributes section.");
+    else
+    {
+      uint8_t new_sh_size[8];
+      size_t width = (elf != NULL && elf->elf64) ? 8 : 4;
+      store(new_sh_size, width, n, big_endian);
+      memset(out + n, 0, slack);
+      ret = armattr_plan_add(plan, size_field, new_sh_size, width, error);
+    }
+  }
+  
+  if (ret == 0)
+  {
+    // only write what changed
+    size_t first = 0, last = size;
+    while (first < last && out[first] == data[first])
+      ++first;
+    while (last > first && out[last-1] == data[last-1])
+      --last;
+    if (first < last)
+      ret = armattr_plan_add(plan, offset + first, out + first, last - first, error);
+  }
+  
+  free(pads);
+  free(out);
+  return ret;
+}
+
+int armattr_plan_attr(struct armattr_plan* plan, const struct armattr_edits* edits,
+                      const struct armattr_attr* attr, off_t offset, struct armattr_error* error)
+{
+  if (armattr_is_removed(edits, attr->tag))
+    return ARMATTR_REBUILD;
+  const struct armattr_tag_value* set = (attr->str.ptr == NULL) ? armattr_find_set(edits, attr->tag) : NULL;
+  if (set == NULL || set->value == attr->value)
+    return 0;
+  // keep the old size, so that nothing else has to move, unless the
+  // new value doesn't fit or the old one is padded beyond any value
+  uint8_t bytes[16];
+  if (armattr_uleb128_size(set->value) > attr->len || attr->len > sizeof(bytes))
+    return ARMATTR_REBUILD;
+  
+  armattr_uleb128_encode(set->value, bytes, attr->len);
+  if (armattr_plan_add(plan, offset, bytes, attr->len, error) != 0)
+    return ARMATTR_ERROR;
+  return 0;
+}
+
+int armattr_plan_section(struct armattr_plan* plan, const struct armattr_edits* edits,
+                         const struct armattr_elf* elf, const uint8_t* data, size_t size,
+                         off_t offset, off_t size_field, struct armattr_error* error)
+{
+  // the edits are of aeabi attributes, which AArch64 files don't have
+  if (elf != NULL && elf->machine == EM_AARCH64)
+    return 0;
+  
+  struct armattr_iter it;
+  if (armattr_iter_init_elf(&it, elf, data, size) != 0)
+  {
+    *error = it.error;
+    return 1;
+  }
+  
+  int first_patch = plan->npatches;
+  size_t first_patch_data = plan->data_len;
+  int rewrite = 0;
+  struct armattr_attr attr;
+  int ret;
+  while ((ret = armattr_next(&it, &attr)) != ARMATTR_END)
+  {
+    if (ret == ARMATTR_ERROR)
+    {
+      *error = it.error;
+      return 1;
+    }
+    if (ret != ARMATTR_ATTR)
+      continue;
+    
+    ret = armattr_plan_attr(plan, edits, &attr, offset + attr.offset, error);
+    if (ret == ARMATTR_ERROR)
+      return 1;
+    if (ret == ARMATTR_REBUILD)
+      rewrite = 1;
+  }
+  
+  if (!rewrite)
+    return 0;
+  
+  // the rebuilt section replaces the patches made in place
+  plan->npatches = first_patch;
+  plan->data_len = first_patch_data;
+  return rewrite_section(plan, edits, elf, data, size, offset, size_field, error);
+}
+
+int armattr_image_section(const struct armattr_elf* elf, const uint8_t* image, size_t size, int* index,
+                          struct armattr_section* section, struct armattr_error* error)
+{
+  size_t shtab_size = (size_t)elf->shnum * elf->shentsize;
+  if (elf->shoff > size || shtab_size > size - elf->shoff)
+  {
+    fail(error, "Section header table outside of the file.");
+    return -1;
+  }
+  
+  // toolchains usually emit .ARM.attributes near the end, so scan backwards
+  if (armattr_next_section(elf, image + elf->shoff, index, section) == 0)
+    return 0;
+  if ((uint64_t)section->offset > size || section->size > size - section->offset)
+  {
+    fail(error, "ARM attributes section outside of the file.");
+    return -1;
+  }
+  section->data = image + section->offset;
+  return 1;
+}
+
+int armattr_plan_image(struct armattr_plan* plan, const struct armattr_edits* edits,
+                       const uint8_t* image, size_t size, struct armattr_error* error)
+{
+  struct armattr_elf elf;
+  if (armattr_read_ehdr(image, size, &elf, error) != 0)
+    return 1;
+  
+  struct armattr_section section;
+  int index = -1;
+  int ret;
+  while ((ret = armattr_image_section(&elf, image, size, &index, &section, error)) > 0)
+  {
+    if (armattr_plan_section(plan, edits, &elf, section.data, section.size, section.offset,
+                             section.size_field, error) != 0)
+      return 1;
+  }
+  return ret < 0;
+}
+
+int armattr_plan_apply(const struct armattr_plan* plan, uint8_t* image, size_t size)
+{
+  for (int i=0; i<plan->npatches; ++i)
+  {
+    const struct armattr_patch* patch = &plan->patches[i];
+    if (patch->offset < 0 || (size_t)patch->offset > size || patch->len > size - patch->offset)
+      return 1;
+  }
+  for (int i=0; i<plan->npatches; ++i)
+  {
+    const struct armattr_patch* patch = &plan->patches[i];
+    memcpy(image + patch->offset, plan->data + patch->data, patch->len);
+  }
+  return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * armattr.h
+ *
+ * Parsing and patching of ARM EABI build attributes
+ * (.ARM.attributes sections) of 32 and 64-bit ELF files
+ * of either byte order, and reading of AArch64 build
+ * attributes, for embedding in other programs.
+ * Everything works on buffers the caller has read in;
+ * nothing here does any I/O or prints anything.
+ *
+ * Attributes are returned as views into the caller's
+ * buffer, and edits are planned as a list of byte
+ * patches that the caller writes out (or applies to an
+ * image in memory with armattr_plan_apply()).
+ *
+ * This code is in the public domain.
+ */
+#ifndef ARMATTR_H
+#define ARMATTR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <elf.h>
+
+/* Why a call failed, as a message like "Unterminated ULEB128." */
+struct armattr_error
+{
+  char msg[128];
+};
+
+/* Reads an ULEB128 value at 'pos' in 'data', without running past
+   'size'. Returns nonzero if it is unterminated. Bits beyond the
+   width of an unsigned long are ignored. */
+int armattr_uleb128(const uint8_t* data, unsigned long* result, size_t* pos, size_t size);
+
+/* Returns the number of bytes 'value' takes as an ULEB128. */
+size_t armattr_uleb128_size(unsigned long value);
+
+/* Writes 'value' as an ULEB128 of exactly 'len' bytes, which must be
+   at least armattr_uleb128_size(value): any extra bytes are redundant
+   continuation bytes, which decode to the same value. */
+void armattr_uleb128_encode(unsigned long value, uint8_t* out, size_t len);
+
+/* How attribute values are encoded: as given for the attributes the
+   ARM ABI addenda define, and otherwise by their convention that tags
+   above 32 are NTBS if odd and ULEB128 if even. */
+#define ARMATTR_ULEB    0
+#define ARMATTR_NTBS    1
+#define ARMATTR_COMPAT  2   // an ULEB128 flag followed by an NTBS
+
+int armattr_encoding(unsigned long tag);
+
+/* A build attribute defined by the ARM ABI addenda, with the meanings
+   of its values where it is an enumeration. */
+struct armattr_tag
+{
+  unsigned long tag;
+  const char* name;
+  int encoding;                // ARMATTR_ULEB, _NTBS or _COMPAT
+  const char* const* values;   // indexed by value, NULL for gaps
+  int nvalues;
+};
+
+const struct armattr_tag* armattr_find_tag(unsigned long tag);
+const struct armattr_tag* armattr_find_tag_name(const char* name);
+
+/* Looks up an attribute of the subsection of 'vendor': "aeabi" for
+   ARM, or one of the AArch64 ones, such as "aeabi_pauthabi". */
+const struct armattr_tag* armattr_find_vendor_tag(const char* vendor, unsigned long tag);
+
+/* An attributes section of an ELF image. */
+struct armattr_section
+{
+  const uint8_t* data;         // its contents, when the image is in memory
+  size_t size;
+  off_t offset;
+  off_t shdr;                  // where its section header is
+  off_t size_field;            // and the sh_size in that
+};
+
+/* The layout of an ELF file: 32 or 64-bit, little or big-endian, ARM
+   or AArch64. */
+struct armattr_elf
+{
+  int elf64;
+  int big_endian;
+  unsigned machine;            // EM_ARM or EM_AARCH64
+  uint64_t shoff;
+  unsigned shnum;
+  unsigned shentsize;
+  
+  // walks the section table; chosen once, for the class and byte order
+  int (*next_section)(const struct armattr_elf* elf, const uint8_t* shtab, int* index,
+                      struct armattr_section* section);
+};
+
+/* Enough bytes for the ELF header of either class. */
+#define ARMATTR_EHDR_SIZE  sizeof(Elf64_Ehdr)
+
+/* Reads the ELF header in the first 'size' bytes of 'data', checking
+   that it is one we can handle. */
+int armattr_read_ehdr(const uint8_t* data, size_t size, struct armattr_elf* elf, struct armattr_error* error);
+
+/* Finds the next attributes section in the section table 'shtab', as
+   read from elf->shoff, scanning backwards from *index (-1 to start at
+   the end). Returns 1 if one was found, or 0 if there are no more.
+   Offsets are from the start of the image, and section->data is not
+   set. */
+int armattr_next_section(const struct armattr_elf* elf, const uint8_t* shtab, int* index,
+                         struct armattr_section* section);
+
+/* A string within the parsed buffer. It is NUL-terminated there, so
+   'ptr' can also be used as a C string while the buffer lives. */
+struct armattr_str
+{
+  const char* ptr;
+  size_t len;
+};
+
+/* Scopes of the attributes in an aeabi sub-subsection. */
+#define ARMATTR_FILE     1
+#define ARMATTR_SECTION  2
+#define ARMATTR_SYMBOL   3
+
+/* One attribute, or one vendor subsection other than "aeabi" (which
+   can't be decoded), as returned by armattr_next(). Offsets are from
+   the start of the section. */
+struct armattr_attr
+{
+  struct armattr_str vendor;
+  size_t offset;               // of the value, or of a vendor subsection
+  size_t len;                  // bytes the value or the subsection takes
+
+  // only for attributes:
+  unsigned long scope;         // ARMATTR_FILE, _SECTION or _SYMBOL
+  const uint8_t* ids;          // ULEB128 section or symbol numbers
+  const uint8_t* ids_end;      // of the scope, 0-terminated
+  unsigned long tag;
+  unsigned long value;         // ULEB128 value, or Tag_compatibility's flag
+  struct armattr_str str;      // NTBS value, or ptr NULL
+};
+
+/* Walks the contents of an attributes section. */
+struct armattr_iter
+{
+  const uint8_t* data;
+  size_t size;
+  size_t pos;                  // of the next subsection
+  const uint8_t* subsect;      // current aeabi subsection, or NULL
+  size_t subsect_size;
+  size_t spos;                 // position within it
+  size_t subsub_end;           // end of the current sub-subsection
+  unsigned long scope;
+  size_t ids, ids_end;
+  struct armattr_str vendor;   // of the current subsection
+  int big_endian;
+  int aarch64;
+  int encoding;                // of the values of an AArch64 subsection
+  struct armattr_error error;
+};
+
+#define ARMATTR_END      0
+#define ARMATTR_ATTR     1
+#define ARMATTR_VENDOR   2
+#define ARMATTR_ERROR   -1
+
+/* Starts walking the section in [data, data + size). Returns nonzero,
+   with the reason in it->error, if it isn't a format we know. */
+int armattr_iter_init(struct armattr_iter* it, const uint8_t* data, size_t size);
+
+/* The same for a section of the ELF file 'elf', whose lengths are in
+   its byte order, and which is in the AArch64 format if it is one. */
+int armattr_iter_init_elf(struct armattr_iter* it, const struct armattr_elf* elf, const uint8_t* data, size_t size);
+
+/* Returns the next attribute (ARMATTR_ATTR) or foreign vendor
+   subsection (ARMATTR_VENDOR) in 'attr', ARMATTR_END after the last
+   one, or ARMATTR_ERROR with the reason in it->error. */
+int armattr_next(struct armattr_iter* it, struct armattr_attr* attr);
+
+/* An attribute and a value. */
+struct armattr_tag_value
+{
+  unsigned long tag;
+  unsigned long value;
+};
+
+/* Changes to make to the attributes: new values for ULEB128 ones,
+   and attributes to delete. */
+struct armattr_edits
+{
+  const struct armattr_tag_value* sets;
+  int nsets;
+  const unsigned long* removes;
+  int nremoves;
+};
+
+const struct armattr_tag_value* armattr_find_set(const struct armattr_edits* edits, unsigned long tag);
+int armattr_is_removed(const struct armattr_edits* edits, unsigned long tag);
+
+/* Bytes to write at 'offset'; they are at 'data' in the plan's pool. */
+struct armattr_patch
+{
+  off_t offset;
+  size_t len;
+  size_t data;
+};
+
+/* The writes that carry out a set of edits. */
+struct armattr_plan
+{
+  struct armattr_patch* patches;
+  int npatches;
+  int patches_cap;
+  uint8_t* data;
+  size_t data_len;
+  size_t data_cap;
+};
+
+void armattr_plan_init(struct armattr_plan* plan);
+void armattr_plan_free(struct armattr_plan* plan);
+
+/* Drops all patches, keeping the memory. */
+void armattr_plan_clear(struct armattr_plan* plan);
+
+int armattr_plan_add(struct armattr_plan* plan, off_t offset, const void* data, size_t len, struct armattr_error* error);
+
+/* Plans 'edits' for one attribute, whose value lies at 'offset' within
+   the file, in place. Returns 0 if that's done (or there is nothing to
+   do), ARMATTR_REBUILD if the attribute is to be removed or its new
+   value doesn't fit, so that the section has to be rebuilt, or
+   ARMATTR_ERROR. */
+#define ARMATTR_REBUILD  1
+
+int armattr_plan_attr(struct armattr_plan* plan, const struct armattr_edits* edits,
+                      const struct armattr_attr* attr, off_t offset, struct armattr_error* error);
+
+/* Plans 'edits' for the attributes section in [data, data + size) of
+   the ELF file 'elf' (NULL for 32-bit little-endian ARM), which lies
+   at 'offset' within the file; 'size_field' is where the section's
+   sh_size is, or 0 if unknown. Values that fit are patched in place.
+   Otherwise the section is rebuilt and padded to its old size with
+   redundant ULEB128 continuation bytes, or failing that shrunk through
+   its sh_size. Fails if the edits need more room than the section
+   has. The edits are of aeabi attributes, so AArch64 sections are
+   left alone. */
+int armattr_plan_section(struct armattr_plan* plan, const struct armattr_edits* edits,
+                         const struct armattr_elf* elf, const uint8_t* data, size_t size,
+                         off_t offset, off_t size_field, struct armattr_error* error);
+
+/* Finds the next attributes section of the ELF image in [image, image +
+   size), whose header was read into 'elf', like armattr_next_section().
+   Returns 1 if one was found, 0 if there are no more, or -1 with the
+   reason in 'error'. */
+int armattr_image_section(const struct armattr_elf* elf, const uint8_t* image, size_t size, int* index,
+                          struct armattr_section* section, struct armattr_error* error);
+
+/* Plans 'edits' for every attributes section of an ELF image. */
+int armattr_plan_image(struct armattr_plan* plan, const struct armattr_edits* edits,
+                       const uint8_t* image, size_t size, struct armattr_error* error);
+
+/* Applies the patches to an image in memory. Returns nonzero if one
+   of them is outside of it. */
+int armattr_plan_apply(const struct armattr_plan* plan, uint8_t* image, size_t size);
+
+#endif
@@ -35,74 +35,9 @@ if [ ! -f "${NDK_ROOT}/ndk-build" ]; then
 	exit 1
 fi
 
-DIR=$(dirname $0)
+DIR=$(cd "$(dirname "$0")" && pwd)
 
-cd $NDK_ROOT/toolchains
-
-STRIP_ELF=$DIR/strip-elf.sh {}
-STRIP_AR=$DIR/strip-ar.sh {}
-
-find . \
-	-name '*.so' -or -name '*.o' \
-	-path "./arm-linux-*/*" \
-	-exec ${STRIP_ELF} \;
-
-find . \
-	-name '*.a' \
-	-path "./arm-linux-*/*" \
-	-exec ${STRIP_AR} \;
-
-cd $NDK_ROOT/platforms
-
-find . \
-	\( -name '*.so' -or -name '*.o' \) \
-	-not -name 'libcrystax.so' \
-	-not -name 'libcrystax_shared.so' \
-	-not -name 'libgnustl_shared.so' \
-	-not -name 'libstlport_shared.so' \
-	-not -name 'libstdc++.so' \
-	-not -name 'libgabi++_shared.so' \
-	-not -name 'libgnuobjc_shared.so'\
-	-path "./android-*/arch-arm/*" \
-	-exec ${STRIP_ELF} \;
-
-find . \
-	\( -name '*.a' \) \
-	-not -name 'libstdc++.a' \
-	-path "./android-*/arch-arm/*" \
-	-exec ${STRIP_AR} \;
-	
-cd $NDK_ROOT/sources
-
-find . \
-	\( -name '*.a' \) \
-	-not -name 'libcrystax_static.a' \
-	-not -name 'libgnustl_static.a' \
-	-not -name 'libstlport_static.a' \
-	-not -name 'libgabi++_static.a' \
-	-not -name 'libgnuobjc_static.a' \
-	-not -name 'libsupc++.a' \
-	-path "*/armeabi*/*" \
-	-exec ${STRIP_AR} \;
-
-find . \
-	\( -name '*.so' \) \
-	-not -name 'libcrystax_shared.so' \
-	-not -name 'libgnustl_shared.so' \
-	-not -name 'libstlport_shared.so' \
-	-not -name 'libgabi++_shared.so' \
-	-not -name 'libgnuobjc_shared.so' \
-	-not -name 'libsupc++.so' \
-	-path "*/armeabi*/*" \
-	-exec ${STRIP_ELF} \;
-
-find . \
-	\( -name '*.a' \) \
-	-not -name 'libcrystax_static.a' \
-	-not -name 'libgnustl_static.a' \
-	-not -name 'libstlport_static.a' \
-	-not -name 'libgabi++_static.a' \
-	-not -name 'libgnuobjc_static.a' \
-	-not -name 'libsupc++.a' \
-	-path "*/armeabi*/*" \
-	-exec ${STRIP_AR} \;
+# ELF files and archives are selected by ndk.rules and
+# handled in a single walk.
+cd $NDK_ROOT || exit 1
+$DIR/arm-wchar-tag -r -w 0 --rules=$DIR/ndk.rules
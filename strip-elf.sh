@@ -1,6 +1,7 @@
 #!/bin/bash
 
 # By zeroing out Tag_ABI_PCS_wchar_t, we indicate that
-# this ELF file is wchar_t-agnostic.
+# this ELF file is wchar_t-agnostic. Any number of files
+# may be given; they are all handled by one process.
 
-$(dirname $0)/arm-wchar-tag $1 0
+$(dirname $0)/arm-wchar-tag -w 0 "$@"
@@ -0,0 +1,410 @@
+#!/usr/bin/env python3
+#
+# check.py
+#
+# Regression checks for arm-wchar-tag: builds small ELF objects and
+# archives, runs the tool on copies of them and compares its output and
+# the bytes it leaves behind.
+#
+#   python3 tests/check.py ./arm-wchar-tag
+#
+# This code is in the public domain.
+
+import json
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+EM_ARM = 40
+EM_AARCH64 = 183
+SHT_ARM_ATTRIBUTES = 0x70000003
+
+def uleb(value):
+  out = b''
+  while True:
+    byte = value & 0x7f
+    value >>= 7
+    if value:
+      out += bytes([byte | 0x80])
+    else:
+      return out + bytes([byte])
+
+def attrs(wchar=4, cpu_name=b'5TE', extra=b''):
+  """File-scope attributes like the ones GCC emits."""
+  body = b''
+  if cpu_name is not None:
+    body += b'\x05' + cpu_name + b'\x00'
+  body += b'\x06\x04\x08\x01\x09\x01'
+  if wchar is not None:
+    body += b'\x12' + uleb(wchar)
+  body += b'\x14\x01\x15\x01\x17\x03\x18\x01\x19\x01\x1a\x02\x1e\x06' + extra
+  return body
+
+def section(body, big=False):
+  """An .ARM.attributes section with 'body' as its file-scope attributes."""
+  e = '>' if big else '<'
+  sub = b'\x01' + struct.pack(e + 'I', 5 + len(body)) + body
+  vendor = b'aeabi\x00' + sub
+  return b'A' + struct.pack(e + 'I', 4 + len(vendor)) + vendor
+
+def aarch64_subsection(vendor, optional, encoding, body):
+  """An AArch64 build attributes subsection."""
+  data = vendor + b'\x00' + bytes([optional, encoding]) + body
+  return struct.pack('<I', 4 + len(data)) + data
+
+def elf(sec, machine=EM_ARM, big=False, cls=32):
+  """A relocatable object with a .text and the attributes section 'sec'."""
+  e = '>' if big else '<'
+  shstr = b'\x00.text\x00.ARM.attributes\x00.shstrtab\x00'
+  text = b'\x00' * 16
+  ehsize = 52 if cls == 32 else 64
+  off_text = ehsize
+  off_sec = off_text + len(text)
+  off_str = off_sec + len(sec)
+  shoff = (off_str + len(shstr) + 7) & ~7
+
+  def shdr(name, kind, flags, off, size, align):
+    if cls == 32:
+      return struct.pack(e + 'IIIIIIIIII', name, kind, flags, 0, off, size, 0, 0, align, 0)
+    return struct.pack(e + 'IIQQQQIIQQ', name, kind, flags, 0, off, size, 0, 0, align, 0)
+
+  shdrs = (shdr(0, 0, 0, 0, 0, 0) + shdr(1, 1, 6, off_text, len(text), 4) +
+           shdr(7, SHT_ARM_ATTRIBUTES, 0, off_sec, len(sec), 1) + shdr(23, 3, 0, off_str, len(shstr), 1))
+  ident = b'\x7fELF' + bytes([1 if cls == 32 else 2, 2 if big else 1, 1, 0]) + b'\x00' * 8
+  if cls == 32:
+    ehdr = ident + struct.pack(e + 'HHIIIIIHHHHHH', 1, machine, 1, 0, 0, shoff, 0x5000000, 52, 0, 0, 40, 4, 3)
+  else:
+    ehdr = ident + struct.pack(e + 'HHIQQQIHHHHHH', 1, machine, 1, 0, 0, shoff, 0, 64, 0, 0, 64, 4, 3)
+  data = ehdr + text + sec + shstr
+  return data + b'\x00' * (shoff - len(data)) + shdrs
+
+def ar_member(name, data, size=None):
+  size = str(len(data)) if size is None else size
+  header = (name.ljust(16) + '0'.ljust(12) + '0'.ljust(6) + '0'.ljust(6) + '644'.ljust(8) +
+            size.ljust(10) + '`\n').encode()
+  return header + data + (b'\n' if len(data) % 2 else b'')
+
+def ar(members):
+  """A GNU archive of (name, data) members, with short names."""
+  return b'!<arch>\n' + b''.join(ar_member(name + '/', data) for name, data in members)
+
+class Checks:
+  def __init__(self, tool, tmp):
+    self.tool = tool
+    self.tmp = tmp
+    self.failed = 0
+
+  def file(self, name, data):
+    """Writes a fixture, returning its name relative to the directory
+    the tool runs in."""
+    path = os.path.join(self.tmp, name)
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, 'wb') as f:
+      f.write(data)
+    return name
+
+  def read(self, name):
+    with open(os.path.join(self.tmp, name), 'rb') as f:
+      return f.read()
+
+  def run(self, *args, stdin=None):
+    try:
+      result = subprocess.run([self.tool] + list(args), input=stdin, capture_output=True, timeout=10, cwd=self.tmp)
+    except subprocess.TimeoutExpired:
+      return -1, b'(timed out)', b''
+    return result.returncode, result.stdout, result.stderr
+
+  def expect(self, name, ok, detail=''):
+    print(('PASS ' if ok else 'FAIL ') + name + ('' if ok or not detail else ': ' + detail))
+    if not ok:
+      self.failed += 1
+
+  def expect_output(self, name, args, rc, output, stdin=None):
+    got_rc, got, _ = self.run(*args, stdin=stdin)
+    self.expect(name, got_rc == rc and got == output, 'rc=%d, output %r' % (got_rc, got))
+
+  def expect_bytes(self, name, path, data):
+    got = self.read(path)
+    if got == data:
+      self.expect(name, True)
+      return
+    diff = [i for i in range(min(len(got), len(data))) if got[i] != data[i]]
+    self.expect(name, False, 'size %d instead of %d, first difference at %s' %
+                (len(got), len(data), diff[0] if diff else 'end'))
+
+def check_batch(c):
+  # in batch mode every status line starts with its file's path
+  no_wchar = c.file('nw.o', elf(section(attrs(None))))
+  wchar = c.file('w.o', elf(section(attrs(2))))
+  c.expect_output('batch: every line prefixed', ['--set', 'Tag_ABI_enum_size=0', no_wchar, wchar], 0,
+                  b'nw.o: Tag_ABI_enum_size = 2, patched to 0\nnw.o: No Tag_ABI_PCS_wchar_t.\n'
+                  b'w.o: Tag_ABI_PCS_wchar_t = 2\nw.o: Tag_ABI_enum_size = 2, patched to 0\n')
+
+def check_rules(c):
+  # ndk.rules selects what the NDK script's find -path "*/armeabi*/*"
+  # did, whose '*' also matched the "." of "./armeabi/...": top-level
+  # armeabi directories included
+  rules = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'ndk.rules')
+  a = elf(section(attrs(4)))
+  for name in ('armeabi/libtop.so', 'armeabi/libgnustl_shared.so', 'armeabi/sub/libsub.so', 'armeabi-v7a/libv7.so',
+               'cxx/libs/armeabi/libdeep.so', 'cxx/libs/x86/libx86.so', 'notarmeabi/libno.so', 'armeabi.so'):
+    c.file('sources/' + name, a)
+  c.file('sources/armeabi-v7a/libv7.a', ar([('a.o', a)]))
+  c.expect_output('rules: ndk sources', ['-r', '--rules=' + rules, 'sources'], 0,
+                  b'sources/armeabi-v7a/libv7.a(a.o): Tag_ABI_PCS_wchar_t = 4\n'
+                  b'sources/armeabi-v7a/libv7.so: Tag_ABI_PCS_wchar_t = 4\n'
+                  b'sources/armeabi/libtop.so: Tag_ABI_PCS_wchar_t = 4\n'
+                  b'sources/armeabi/sub/libsub.so: Tag_ABI_PCS_wchar_t = 4\n'
+                  b'sources/cxx/libs/armeabi/libdeep.so: Tag_ABI_PCS_wchar_t = 4\n')
+
+def check_archives(c):
+  a = elf(section(attrs(4)))
+  b = elf(section(attrs(2)))
+  lib = c.file('lib.a', ar([('a.o', a), ('b.o', b + b'\x00')]))
+  c.expect_output('archive: display members', [lib], 0,
+                  b'a.o: Tag_ABI_PCS_wchar_t = 4\nb.o: Tag_ABI_PCS_wchar_t = 2\n')
+  c.run('-w', '0', lib)
+  c.expect_bytes('archive: patched in place', lib,
+                 ar([('a.o', elf(section(attrs(0)))), ('b.o', elf(section(attrs(0))) + b'\x00')]))
+
+  # with prefetching, members are parsed from the archive's blocks,
+  # which 1 KB blocks make them straddle
+  def members(wchar):
+    return [('m%d.o' % i, elf(section(attrs(wchar))) + b'\x00' * (i * 300)) for i in range(8)]
+  for size in ('1', '64'):
+    lib = c.file('prefetch%s.a' % size, ar(members(4)))
+    c.expect_output('archive: display with %s KB prefetch' % size, ['--prefetch=' + size, lib], 0,
+                    b''.join(b'%s: Tag_ABI_PCS_wchar_t = 4\n' % name.encode() for name, _ in members(4)))
+    c.run('--prefetch=' + size, '-w', '0', lib)
+    c.expect_bytes('archive: patched with %s KB prefetch' % size, lib, ar(members(0)))
+
+  long_name = 'a_member_with_a_long_name.o'
+  bsd = c.file('bsd.a', b'!<arch>\n' + ar_member('#1/%d' % len(long_name), long_name.encode() + a))
+  c.expect_output('archive: BSD long name', [bsd], 0, long_name.encode() + b': Tag_ABI_PCS_wchar_t = 4\n')
+
+  for size in ('-60', 'zz', str(len(a) + 100)):
+    bad = c.file('bad.a', b'!<arch>\n' + ar_member('a.o/', a, size))
+    c.expect_output('archive: member size %s rejected' % size, [bad], 1,
+                    b'bad.a: Error: Corrupt archive member header at offset 8.\n')
+
+def shdr_size(data, index, big=False, cls=32):
+  """The sh_size of section 'index' of an object built by elf()."""
+  e = '>' if big else '<'
+  if cls == 32:
+    shoff, = struct.unpack_from(e + 'I', data, 32)
+    return struct.unpack_from(e + 'I', data, shoff + index * 40 + 20)[0]
+  shoff, = struct.unpack_from(e + 'Q', data, 40)
+  return struct.unpack_from(e + 'Q', data, shoff + index * 64 + 32)[0]
+
+def check_rebuild(c):
+  # removed bytes are absorbed as redundant continuation bytes in the
+  # last value, Tag_ABI_optimization_goals
+  body = attrs(4)
+  padded = attrs(4, cpu_name=None).replace(b'\x1e\x06', b'\x1e\x86\x80\x80\x80\x80\x00')
+  a = c.file('a.o', elf(section(body)))
+  c.expect_output('rebuild: remove a string', ['--remove', 'Tag_CPU_name', a], 0,
+                  b'Tag_CPU_name = 5TE, removed\nTag_ABI_PCS_wchar_t = 4\n')
+  c.expect_bytes('rebuild: removal padded', a, elf(section(padded)))
+  c.expect_output('rebuild: padded values decode', ['--query=Tag_ABI_optimization_goals', a], 0,
+                  b'{"path":"a.o","member":null,"vendor":"aeabi","scope":"file","tag":"Tag_ABI_optimization_goals",'
+                  b'"number":30,"value":6,"decoded":"Aggressive Debug","offset":105}\n')
+
+  # a value that grows takes room from a removed one
+  grown = attrs(4, cpu_name=None).replace(b'\x18\x01', b'\x18\xac\x02').replace(b'\x1e\x06', b'\x1e\x86\x80\x80\x80\x00')
+  b = c.file('b.o', elf(section(body)))
+  c.run('--set', '24=300', '--remove', '5', b)
+  c.expect_bytes('rebuild: grown value', b, elf(section(grown)))
+
+  # with nothing left to pad, the section is shrunk through sh_size
+  everything = ['--remove=%d' % tag for tag in (5, 6, 8, 9, 18, 20, 21, 23, 24, 25, 26, 30)]
+  d = c.file('d.o', elf(section(body)))
+  c.run(*(everything + [d]))
+  data = c.read(d)
+  empty = section(b'')
+  c.expect('rebuild: shrunk through sh_size', shdr_size(data, 2) == len(empty) and data[68:68 + len(empty)] == empty,
+           'sh_size %d' % shdr_size(data, 2))
+
+  # growing without room fails and leaves the file alone
+  original = elf(section(attrs(4, cpu_name=None)))
+  e = c.file('e.o', original)
+  c.expect_output('rebuild: no room', ['--set', '24=300', e], 1,
+                  b'Error: No room in the ARM attributes section for the new values.\n')
+  c.expect_bytes('rebuild: no room leaves the file alone', e, original)
+
+  # a value padded beyond any ULEB128 is rebuilt rather than patched in
+  # place, from a parse or from an index record
+  overlong = attrs(None, extra=b'\x12\x84' + b'\x80' * 25 + b'\x00')
+  repadded = (attrs(None).replace(b'\x19\x01', b'\x19\x81\x80\x00')
+              .replace(b'\x1a\x02', b'\x1a\x82' + b'\x80' * 7 + b'\x00')
+              .replace(b'\x1e\x06', b'\x1e\x86' + b'\x80' * 7 + b'\x00') + b'\x12' + b'\x80' * 8 + b'\x00')
+  f = c.file('f.o', elf(section(overlong)))
+  c.expect_output('rebuild: overlong value', ['-w', '0', f], 0, b'Tag_ABI_PCS_wchar_t = 4, patched to 0\n')
+  c.expect_bytes('rebuild: overlong value repadded', f, elf(section(repadded)))
+  g = c.file('g.o', elf(section(overlong)))
+  c.run('--index', 'overlong.idx', g)
+  c.expect_output('rebuild: overlong value from the index', ['--index', 'overlong.idx', '-w', '0', g], 0,
+                  b'Tag_ABI_PCS_wchar_t = 4, patched to 0\n')
+  c.expect_bytes('rebuild: overlong value from the index repadded', g, elf(section(repadded)))
+
+def check_memo(c):
+  # identical sections are decoded once; the others are patched from
+  # the memo at their own offsets
+  body = attrs(4)
+  names = [c.file('m%d.o' % i, elf(section(body))) for i in range(3)]
+  shifted = c.file('m3.o', elf(section(body)) + b'\x00')
+  lib = c.file('m.a', ar([('a.o', elf(section(body))), ('b.o', elf(section(body)))]))
+  c.expect_output('memo: display', names, 0,
+                  b''.join(b'%s: Tag_ABI_PCS_wchar_t = 4\n' % name.encode() for name in names))
+  c.run('-w', '0', *(names + [shifted, lib]))
+  patched = elf(section(attrs(0)))
+  for name in names:
+    c.expect_bytes('memo: %s patched' % name, name, patched)
+  c.expect_bytes('memo: archive members patched', lib, ar([('a.o', patched), ('b.o', patched)]))
+  c.expect_bytes('memo: trailing byte kept', shifted, patched + b'\x00')
+
+  # rebuilds from the memo too
+  removed = [c.file('r%d.o' % i, elf(section(body))) for i in range(2)]
+  c.run('--remove', '5', *removed)
+  padded = attrs(4, cpu_name=None).replace(b'\x1e\x06', b'\x1e\x86\x80\x80\x80\x80\x00')
+  for name in removed:
+    c.expect_bytes('memo: %s rebuilt' % name, name, elf(section(padded)))
+
+def check_signatures(c):
+  # GNU's armel layout is built in, and unknown ones are learned from
+  # the first section parsed
+  known = c.file('k.o', elf(section(attrs(4))))
+  learned = [c.file('l%d.o' % wchar, elf(section(attrs(wchar, cpu_name=b'XYZ')))) for wchar in (4, 2, 130)]
+  rc, out, err = c.run('--stats', known, *learned)
+  c.expect('signatures: values found', rc == 0 and out == b'k.o: Tag_ABI_PCS_wchar_t = 4\nl4.o: Tag_ABI_PCS_wchar_t = 4\n'
+           b'l2.o: Tag_ABI_PCS_wchar_t = 2\nl130.o: Tag_ABI_PCS_wchar_t = 130\n', repr(out))
+  c.expect('signatures: matched', err == b'Signatures: 3 of 4 sections matched a known layout (75.0%); 1 layouts learned.\n',
+           repr(err))
+
+def check_malformed(c):
+  # lengths that don't fit are errors, whichever path reads them first
+  good = section(attrs(4))
+  truncated = c.file('truncated.o', elf(good[:-3]))
+  c.expect_output('malformed: truncated section', [truncated], 1,
+                  b'Error: ARM attribute subsection outside of section bounds.\n')
+  huge = bytearray(good)
+  struct.pack_into('<I', huge, 12, 0x7fffffff)
+  huge = c.file('huge.o', elf(bytes(huge)))
+  c.expect_output('malformed: sub-subsection too long', [huge], 1,
+                  b'Error: aeabi sub-subsection outside of subsection bounds.\n')
+  short = bytearray(good)
+  struct.pack_into('<I', short, 1, 4)
+  short = c.file('short.o', elf(bytes(short)))
+  c.expect_output('malformed: subsection too short', [short], 1, b'Error: Unterminated NTBS.\n')
+  tiny = c.file('tiny.o', elf(b'A' + struct.pack('<I', 4) + b'aeabi\x00\x01' + struct.pack('<I', 0x7fffffff) + b'\x05\x00'))
+  c.expect_output('malformed: short subsection with a long sub-subsection', [tiny], 1, b'Error: Unterminated NTBS.\n')
+  for name in (truncated, huge, short, tiny):
+    c.run('-w', '0', name)
+  c.expect('malformed: nothing patched', c.read(truncated) == elf(good[:-3]))
+
+def check_formats(c):
+  # the same patch in every byte order and class
+  for big in (False, True):
+    for cls in (32, 64):
+      label = '%s ELF%d' % ('big-endian' if big else 'little-endian', cls)
+      name = c.file('f.o', elf(section(attrs(4), big=big), big=big, cls=cls))
+      c.expect_output('formats: %s patched' % label, ['-w', '0', name], 0, b'Tag_ABI_PCS_wchar_t = 4, patched to 0\n')
+      c.expect_bytes('formats: %s patched' % label, name, elf(section(attrs(0), big=big), big=big, cls=cls))
+
+  # AArch64 tags share numbers with aeabi ones, but aren't edited,
+  # whether the section is parsed or found in the memo
+  aarch64 = elf(b'A' + aarch64_subsection(b'aeabi_pauthabi', 1, 0, b'\x06\x05\x08\x07'), machine=EM_AARCH64, cls=64)
+  for count in (1, 3):
+    names = [c.file('a%d.o' % i, aarch64) for i in range(count)]
+    c.run('--set', '6=9', *names)
+    c.run('-w', '0', *names)
+    for name in names:
+      c.expect_bytes('formats: AArch64 untouched', name, aarch64)
+  rc, out, err = c.run('--dump', names[0])
+  c.expect('formats: AArch64 dump', rc == 0 and b'"vendor":"aeabi_pauthabi"' in out and b'"number":6,"value":5' in out, repr(out))
+
+# The public tags of the addenda to the ARM ABI, "Addenda to, and
+# Errata in, the ABI for the Arm Architecture": number, name, encoding.
+ADDENDA_TAGS = [
+  (4, 'Tag_CPU_raw_name', 'ntbs'), (5, 'Tag_CPU_name', 'ntbs'), (6, 'Tag_CPU_arch', 'uleb'),
+  (7, 'Tag_CPU_arch_profile', 'uleb'), (8, 'Tag_ARM_ISA_use', 'uleb'), (9, 'Tag_THUMB_ISA_use', 'uleb'),
+  (10, 'Tag_FP_arch', 'uleb'), (11, 'Tag_WMMX_arch', 'uleb'), (12, 'Tag_Advanced_SIMD_arch', 'uleb'),
+  (13, 'Tag_PCS_config', 'uleb'), (14, 'Tag_ABI_PCS_R9_use', 'uleb'), (15, 'Tag_ABI_PCS_RW_data', 'uleb'),
+  (16, 'Tag_ABI_PCS_RO_data', 'uleb'), (17, 'Tag_ABI_PCS_GOT_use', 'uleb'), (18, 'Tag_ABI_PCS_wchar_t', 'uleb'),
+  (19, 'Tag_ABI_FP_rounding', 'uleb'), (20, 'Tag_ABI_FP_denormal', 'uleb'), (21, 'Tag_ABI_FP_exceptions', 'uleb'),
+  (22, 'Tag_ABI_FP_user_exceptions', 'uleb'), (23, 'Tag_ABI_FP_number_model', 'uleb'),
+  (24, 'Tag_ABI_align_needed', 'uleb'), (25, 'Tag_ABI_align_preserved', 'uleb'), (26, 'Tag_ABI_enum_size', 'uleb'),
+  (27, 'Tag_ABI_HardFP_use', 'uleb'), (28, 'Tag_ABI_VFP_args', 'uleb'), (29, 'Tag_ABI_WMMX_args', 'uleb'),
+  (30, 'Tag_ABI_optimization_goals', 'uleb'), (31, 'Tag_ABI_FP_optimization_goals', 'uleb'),
+  (32, 'Tag_compatibility', 'compat'), (34, 'Tag_CPU_unaligned_access', 'uleb'), (36, 'Tag_FP_HP_extension', 'uleb'),
+  (38, 'Tag_ABI_FP_16bit_format', 'uleb'), (42, 'Tag_MPextension_use', 'uleb'), (44, 'Tag_DIV_use', 'uleb'),
+  (46, 'Tag_DSP_extension', 'uleb'), (48, 'Tag_MVE_arch', 'uleb'), (50, 'Tag_PAC_extension', 'uleb'),
+  (52, 'Tag_BTI_extension', 'uleb'), (64, 'Tag_nodefaults', 'uleb'), (65, 'Tag_also_compatible_with', 'ntbs'),
+  (66, 'Tag_T2EE_use', 'uleb'), (67, 'Tag_conformance', 'ntbs'), (68, 'Tag_Virtualization_use', 'uleb'),
+  (70, 'Tag_MPextension_use_legacy', 'uleb'), (74, 'Tag_BTI_use', 'uleb'), (76, 'Tag_PACRET_use', 'uleb'),
+]
+
+def check_tag_table(c):
+  # tags above 32 that the addenda don't define are NTBS when odd and
+  # ULEB128 when even, so that unknown ones can be skipped; the defined
+  # ones follow the same rule
+  rule = [number for number, _, encoding in ADDENDA_TAGS if number > 32 and (number % 2 == 1) != (encoding == 'ntbs')]
+  c.expect('tags: odd tags above 32 are strings', not rule, repr(rule))
+
+  expected = ADDENDA_TAGS + [(number, 'Tag_%d' % number, 'ntbs' if number % 2 else 'uleb')
+                             for number in (33, 35, 40, 69, 71, 80, 81, 127, 128, 129)]
+  body = b''
+  for number, _, encoding in expected:
+    if encoding == 'ntbs':
+      body += uleb(number) + b'x%d\x00' % number
+    elif encoding == 'compat':
+      body += uleb(number) + b'\x01gnu\x00'
+    else:
+      body += uleb(number) + uleb(number + 200)
+  name = c.file('tags.o', elf(section(body)))
+  rc, out, _ = c.run('--dump', name)
+  records = [json.loads(line) for line in out.splitlines()]
+  c.expect('tags: every tag dumped', rc == 0 and len(records) == len(expected), 'rc=%d, %d records' % (rc, len(records)))
+  for (number, tag, encoding), record in zip(expected, records):
+    if encoding == 'ntbs':
+      value = {'value': 'x%d' % number}
+    elif encoding == 'compat':
+      value = {'value': 1, 'string': 'gnu'}
+    else:
+      value = {'value': number + 200}
+    got = {key: record.get(key) for key in ['number', 'tag'] + list(value)}
+    c.expect('tags: %d is %s, %s' % (number, tag, encoding), got == dict(number=number, tag=tag, **value), repr(record))
+
+  # value names that have been wrong before
+  hardfp = ['As Tag_FP_arch', 'SP only', 'Reserved', 'Deprecated']
+  name = c.file('hardfp.o', elf(section(b''.join(b'\x1b' + uleb(value) for value in range(len(hardfp))))))
+  rc, out, _ = c.run('--dump', name)
+  c.expect('tags: Tag_ABI_HardFP_use values', [json.loads(line).get('decoded') for line in out.splitlines()] == hardfp,
+           repr(out))
+
+def main():
+  if len(sys.argv) != 2:
+    print('Usage: check.py ARM_WCHAR_TAG')
+    return 2
+
+  with tempfile.TemporaryDirectory() as tmp:
+    c = Checks(os.path.abspath(sys.argv[1]), tmp)
+    check_batch(c)
+    check_rules(c)
+    check_archives(c)
+    check_rebuild(c)
+    check_memo(c)
+    check_signatures(c)
+    check_malformed(c)
+    check_formats(c)
+    check_tag_table(c)
+
+  if c.failed:
+    print('%d checks failed.' % c.failed)
+    return 1
+  print('All checks passed.')
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -0,0 +1,251 @@
+/*
+ * simd.c
+ *
+ * Checks and benchmarks of the vectorized scans in armattr.c against
+ * plain byte loops. armattr.c is included, to get at find_end().
+ *
+ *   simd check    compare on terminators at every window boundary
+ *   simd bench    time ULEB128 decoding and NTBS scanning
+ *
+ * tests/simd.sh builds it without SIMD, and with SSE2 and AVX2 where
+ * the machine has them, and runs both.
+ *
+ * This code is in the public domain.
+ */
+#include "../armattr.c"
+
+#include <time.h>
+
+/* The per-byte loops find_end() and armattr_uleb128() replaced. */
+static size_t scalar_end(const uint8_t* data, size_t pos, size_t size, int nul)
+{
+  while (pos < size && (nul ? data[pos] != 0 : (data[pos] & 0x80) != 0))
+    ++pos;
+  return pos;
+}
+
+static int scalar_uleb128(const uint8_t* data, unsigned long* result, size_t* pos, size_t size)
+{
+  unsigned shift = 0;
+  *result = 0;
+  while (*pos < size)
+  {
+    uint8_t byte = data[(*pos)++];
+    if (shift < sizeof(*result) * 8)
+      *result |= (unsigned long)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+      break;
+    if (*pos >= size)
+      return 1;
+    shift += 7;
+  }
+  return 0;
+}
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint8_t random_byte()
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return (uint8_t)rng;
+}
+
+/* A byte that doesn't end a value or string. */
+static uint8_t filler(int nul)
+{
+  uint8_t byte = random_byte();
+  return nul ? (byte | 1) : (byte | 0x80);
+}
+
+/* A byte that does. */
+static uint8_t terminator(int nul)
+{
+  return nul ? 0 : (random_byte() & 0x7f);
+}
+
+static int check()
+{
+  enum { MAX = 100 };
+  uint8_t data[MAX];
+  unsigned long cases = 0, failed = 0;
+
+  // every buffer size, start and terminator position up to past three
+  // AVX2 windows, so that terminators land on both sides of each edge
+  for (int nul=0; nul<2; ++nul)
+  {
+    for (size_t size=0; size<=MAX; ++size)
+    {
+      for (size_t end=0; end<=size; ++end)
+      {
+        for (size_t pos=0; pos<=end && pos<=40; ++pos)
+        {
+          for (size_t i=0; i<size; ++i)
+            data[i] = (i == end) ? terminator(nul) : (i < end) ? filler(nul) : random_byte();
+          size_t want = scalar_end(data, pos, size, nul);
+          size_t got = find_end(data, pos, size, nul);
+          ++cases;
+          if (got != want && failed++ < 10)
+            printf("find_end(nul=%d, pos=%zu, size=%zu): %zu instead of %zu\n", nul, pos, size, got, want);
+        }
+      }
+    }
+  }
+
+  // values of every length, truncated or not, followed by anything
+  for (int round=0; round<200000; ++round)
+  {
+    size_t len = 1 + random_byte() % 24;
+    size_t size = len + random_byte() % 40;
+    if (size > MAX)
+      size = MAX;
+    for (size_t i=0; i<size; ++i)
+      data[i] = (i + 1 < len) ? filler(0) : (i + 1 == len) ? terminator(0) : random_byte();
+    if (random_byte() & 1)
+      size = len - 1 - (len > 1 ? random_byte() % (len - 1) : 0);
+
+    unsigned long want, got;
+    size_t want_pos = 0, got_pos = 0;
+    int want_ret = scalar_uleb128(data, &want, &want_pos, size);
+    int got_ret = armattr_uleb128(data, &got, &got_pos, size);
+    ++cases;
+    if ((got_ret != want_ret || got_pos != want_pos || (!want_ret && got != want)) && failed++ < 10)
+      printf("armattr_uleb128(len=%zu, size=%zu): %d, %lu at %zu instead of %d, %lu at %zu\n",
+             len, size, got_ret, got, got_pos, want_ret, want, want_pos);
+  }
+
+  printf("%lu cases, %lu mismatches\n", cases, failed);
+  return failed != 0;
+}
+
+typedef int (*decode_fn)(const uint8_t* data, unsigned long* result, size_t* pos, size_t size);
+typedef size_t (*scan_fn)(const uint8_t* data, size_t pos, size_t size, int nul);
+
+static size_t simd_end(const uint8_t* data, size_t pos, size_t size, int nul)
+{
+  return find_end(data, pos, size, nul);
+}
+
+static size_t memchr_end(const uint8_t* data, size_t pos, size_t size, int nul)
+{
+  (void)nul;
+  const uint8_t* end = memchr(data + pos, 0, size - pos);
+  return end ? (size_t)(end - data) : size;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+enum { BENCH_SIZE = 1 << 20, BENCH_ROUNDS = 50 };
+
+/* Best throughput in MB/s of five runs decoding the whole buffer. */
+static double bench_decode(volatile decode_fn fn, const uint8_t* data, size_t size)
+{
+  double best = 0;
+  unsigned long sum = 0;
+  for (int run=0; run<5; ++run)
+  {
+    double start = now();
+    for (int round=0; round<BENCH_ROUNDS; ++round)
+    {
+      unsigned long value;
+      for (size_t pos=0; pos<size && fn(data, &value, &pos, size) == 0; )
+        sum += value;
+    }
+    double rate = (double)size * BENCH_ROUNDS / (now() - start) / 1e6;
+    if (rate > best)
+      best = rate;
+  }
+  if (sum == 42)
+    printf(" ");
+  return best;
+}
+
+static double bench_scan(volatile scan_fn fn, const uint8_t* data, size_t size)
+{
+  double best = 0;
+  size_t sum = 0;
+  for (int run=0; run<5; ++run)
+  {
+    double start = now();
+    for (int round=0; round<BENCH_ROUNDS; ++round)
+    {
+      for (size_t pos=0; pos<size; )
+      {
+        size_t end = fn(data, pos, size, 1);
+        sum += end - pos;
+        pos = end + 1;
+      }
+    }
+    double rate = (double)size * BENCH_ROUNDS / (now() - start) / 1e6;
+    if (rate > best)
+      best = rate;
+  }
+  if (sum == 42)
+    printf(" ");
+  return best;
+}
+
+static int bench()
+{
+  uint8_t* data = malloc(BENCH_SIZE);
+  if (data == NULL)
+  {
+    perror("allocating buffer");
+    return 1;
+  }
+
+  // values of one or two bytes, like nearly all tags and values
+  size_t size = 0;
+  while (size + 2 <= BENCH_SIZE)
+  {
+    if (random_byte() & 3)
+      data[size++] = terminator(0);
+    else
+    {
+      data[size++] = filler(0);
+      data[size++] = terminator(0);
+    }
+  }
+  printf("1-2 byte ULEB128:  %7.0f MB/s loop, %7.0f MB/s armattr_uleb128()\n",
+         bench_decode(scalar_uleb128, data, size), bench_decode(armattr_uleb128, data, size));
+
+  // values padded to nine bytes, as armattr_plan_section() leaves them
+  for (size = 0; size + 9 <= BENCH_SIZE; size += 9)
+  {
+    for (int i=0; i<8; ++i)
+      data[size + i] = filler(0);
+    data[size + 8] = 0;
+  }
+  printf("9-byte ULEB128:    %7.0f MB/s loop, %7.0f MB/s armattr_uleb128()\n",
+         bench_decode(scalar_uleb128, data, size), bench_decode(armattr_uleb128, data, size));
+
+  // strings of 3 to 30 bytes, like CPU names and vendors
+  for (size = 0; size + 31 <= BENCH_SIZE; )
+  {
+    size_t len = 3 + random_byte() % 28;
+    for (size_t i=0; i<len; ++i)
+      data[size++] = filler(1);
+    data[size++] = 0;
+  }
+  printf("3-30 byte NTBS:    %7.0f MB/s loop, %7.0f MB/s find_end(), %7.0f MB/s memchr()\n",
+         bench_scan(scalar_end, data, size), bench_scan(simd_end, data, size), bench_scan(memchr_end, data, size));
+
+  free(data);
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc == 2 && strcmp(argv[1], "check") == 0)
+    return check();
+  if (argc == 2 && strcmp(argv[1], "bench") == 0)
+    return bench();
+  fprintf(stderr, "Usage: %s check|bench\n", argv[0]);
+  return 2;
+}
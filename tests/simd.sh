@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Builds tests/simd.c with the scalar loops only, and with each vector
+# instruction set this machine has, then checks every build against
+# the byte loops and benchmarks it.
+#
+#   tests/simd.sh [check|bench]    (both by default)
+
+set -e
+cd "$(dirname "$0")"
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+builds=("scalar -DARMATTR_NO_SIMD")
+case "$(uname -m)" in
+  x86_64)
+    builds+=("sse2 -msse2")
+    grep -qw avx2 /proc/cpuinfo && builds+=("avx2 -mavx2")
+    ;;
+  aarch64|arm*)
+    builds+=("neon")
+    ;;
+esac
+
+status=0
+for build in "${builds[@]}"; do
+  name=${build%% *}
+  flags=${build#"$name"}
+  ${CC:-gcc} -std=gnu99 -O2 $flags -o "$out/simd-$name" simd.c
+  for mode in ${1:-check bench}; do
+    echo "$name $mode:"
+    "$out/simd-$name" "$mode" || status=1
+  done
+done
+exit $status